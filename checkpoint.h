@@ -0,0 +1,62 @@
+#ifndef __CS267_CHECKPOINT_H__
+#define __CS267_CHECKPOINT_H__
+
+#include <pthread.h>
+#include "common.h"
+
+//
+//  checkpoint file: a header with the parameters of the run and the step
+//  to continue from, followed by all n particle_t; the random number state
+//  is the seed, which only the initial configuration depends on
+//
+const char CHECKPOINT_MAGIC[8] = { 'C', 'S', '2', '6', '7', 'C', 'K', 'P' };
+const int CHECKPOINT_VERSION = 1;
+
+typedef struct
+{
+    char magic[8];
+    int version;
+    int reserved;
+    long long n;
+    long long step;
+    double size;
+    double dt;
+    long long seed;
+} checkpoint_header_t;
+
+//
+//  checkpoints written by a background thread from a copy of the
+//  particles; a new checkpoint waits (stalls) while the previous one is
+//  still being written; with direct > 0 they are written with O_DIRECT and
+//  that many writes in flight
+//
+typedef struct
+{
+    char *filename;
+    int n;
+    int direct;
+    particle_t *copy;
+    long long step;
+    bool pending;
+    bool stop;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t ready, done;
+    int written;
+    int stalls;
+    double stallTime;
+    double writeTime;
+} checkpoint_t;
+
+void initCheckpointHeader( checkpoint_header_t *header, int n, long long step );
+bool writeCheckpoint( const char *filename, long long step, int n, particle_t *p );
+bool writeDirectCheckpoint( const char *filename, long long step, int n, particle_t *p, int depth );
+bool readCheckpointHeader( const char *filename, checkpoint_header_t *header );
+bool readCheckpoint( const char *filename, long long first, long long count, particle_t *p );
+
+checkpoint_t *startCheckpoints( const char *filename, int n );
+void directCheckpoints( checkpoint_t *c, int depth );
+void saveCheckpoint( checkpoint_t *c, long long step, particle_t *p );
+void stopCheckpoints( checkpoint_t *c );
+
+#endif
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "checkpoint.h"
+#include "direct.h"
+
+void initCheckpointHeader( checkpoint_header_t *header, int n, long long step )
+{
+    memset( header, 0, sizeof(checkpoint_header_t) );
+    memcpy( header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC) );
+    header->version = CHECKPOINT_VERSION;
+    header->n = n;
+    header->step = step;
+    header->size = getSize();
+    header->dt = getDt();
+    header->seed = get_seed();
+}
+
+static char *temporaryName( const char *filename )
+{
+    size_t length = strlen( filename );
+    char *temporary = (char*) malloc( length + 5 );
+    memcpy( temporary, filename, length );
+    memcpy( temporary + length, ".tmp", 5 );
+    return temporary;
+}
+
+//
+//  write to a temporary file and rename it over the previous checkpoint, so
+//  a run killed while writing still leaves the last complete one behind
+//
+bool writeCheckpoint( const char *filename, long long step, int n, particle_t *p )
+{
+    char *temporary = temporaryName( filename );
+    FILE *f = fopen( temporary, "wb" );
+    bool complete = f != NULL;
+    if( f )
+    {
+        checkpoint_header_t header;
+        initCheckpointHeader( &header, n, step );
+        complete = fwrite( &header, sizeof(checkpoint_header_t), 1, f ) == 1 &&
+                   fwrite( p, sizeof(particle_t), n, f ) == (size_t)n &&
+                   fflush( f ) == 0 && fsync( fileno( f ) ) == 0;
+        complete = fclose( f ) == 0 && complete;
+    }
+    if( complete )
+        complete = rename( temporary, filename ) == 0;
+    if( !complete )
+        fprintf( stderr, "failed to write checkpoint %s\n", filename );
+    free( temporary );
+    return complete;
+}
+
+bool readCheckpointHeader( const char *filename, checkpoint_header_t *header )
+{
+    FILE *f = fopen( filename, "rb" );
+    if( !f )
+    {
+        fprintf( stderr, "cannot open checkpoint %s\n", filename );
+        return false;
+    }
+    bool valid = fread( header, sizeof(checkpoint_header_t), 1, f ) == 1 &&
+                 memcmp( header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC) ) == 0 &&
+                 header->version == CHECKPOINT_VERSION;
+    fclose( f );
+    if( !valid )
+        fprintf( stderr, "%s is not a checkpoint of version %d\n", filename, CHECKPOINT_VERSION );
+    return valid;
+}
+
+//
+//  particles [first, first + count) of a checkpoint
+//
+bool readCheckpoint( const char *filename, long long first, long long count, particle_t *p )
+{
+    FILE *f = fopen( filename, "rb" );
+    if( !f )
+        return false;
+    fseeko( f, sizeof(checkpoint_header_t) + first * sizeof(particle_t), SEEK_SET );
+    bool complete = fread( p, sizeof(particle_t), count, f ) == (size_t)count;
+    fclose( f );
+    if( !complete )
+        fprintf( stderr, "checkpoint %s is truncated\n", filename );
+    return complete;
+}
+
+//
+//  the same with O_DIRECT and up to depth writes in flight
+//
+bool writeDirectCheckpoint( const char *filename, long long step, int n, particle_t *p, int depth )
+{
+    char *temporary = temporaryName( filename );
+    direct_file_t *d = openDirect( temporary, depth );
+    bool complete = d != NULL;
+    if( d )
+    {
+        checkpoint_header_t header;
+        initCheckpointHeader( &header, n, step );
+        appendDirect( d, &header, sizeof(checkpoint_header_t) );
+        appendDirect( d, p, (size_t)n * sizeof(particle_t) );
+        complete = finishDirect( d, NULL, 0, true );
+        freeDirect( d );
+    }
+    if( complete )
+        complete = rename( temporary, filename ) == 0;
+    if( !complete )
+        fprintf( stderr, "failed to write checkpoint %s\n", filename );
+    free( temporary );
+    return complete;
+}
+
+//
+//  background writer: writes the copy whenever one is pending
+//
+static void *checkpointThread( void *arg )
+{
+    checkpoint_t *c = (checkpoint_t*) arg;
+    pthread_mutex_lock( &c->lock );
+    while( true )
+    {
+        while( !c->pending && !c->stop )
+            pthread_cond_wait( &c->ready, &c->lock );
+        if( !c->pending )
+            break;
+        pthread_mutex_unlock( &c->lock );
+
+        double start = read_timer( );
+        if( c->direct > 0 )
+            writeDirectCheckpoint( c->filename, c->step, c->n, c->copy, c->direct );
+        else
+            writeCheckpoint( c->filename, c->step, c->n, c->copy );
+        double elapsed = read_timer( ) - start;
+
+        pthread_mutex_lock( &c->lock );
+        c->writeTime += elapsed;
+        c->written++;
+        c->pending = false;
+        pthread_cond_signal( &c->done );
+    }
+    pthread_mutex_unlock( &c->lock );
+    return NULL;
+}
+
+checkpoint_t *startCheckpoints( const char *filename, int n )
+{
+    checkpoint_t *c = (checkpoint_t*) calloc( 1, sizeof(checkpoint_t) );
+    c->filename = strdup( filename );
+    c->n = n;
+    c->copy = (particle_t*) malloc( max( n, 1 ) * sizeof(particle_t) );
+    pthread_mutex_init( &c->lock, NULL );
+    pthread_cond_init( &c->ready, NULL );
+    pthread_cond_init( &c->done, NULL );
+    pthread_create( &c->writer, NULL, checkpointThread, c );
+    return c;
+}
+
+//
+//  before the first checkpoint
+//
+void directCheckpoints( checkpoint_t *c, int depth )
+{
+    c->direct = max( depth, 1 );
+}
+
+//
+//  copy the particles, which are at the start of step, and let the thread
+//  write them
+//
+void saveCheckpoint( checkpoint_t *c, long long step, particle_t *p )
+{
+    pthread_mutex_lock( &c->lock );
+    if( c->pending )
+    {
+        double stall = read_timer( );
+        c->stalls++;
+        while( c->pending )
+            pthread_cond_wait( &c->done, &c->lock );
+        c->stallTime += read_timer( ) - stall;
+    }
+    memcpy( c->copy, p, c->n * sizeof(particle_t) );
+    c->step = step;
+    c->pending = true;
+    pthread_cond_signal( &c->ready );
+    pthread_mutex_unlock( &c->lock );
+}
+
+void stopCheckpoints( checkpoint_t *c )
+{
+    pthread_mutex_lock( &c->lock );
+    c->stop = true;
+    pthread_cond_signal( &c->ready );
+    pthread_mutex_unlock( &c->lock );
+    pthread_join( c->writer, NULL );
+
+    printf( "checkpoints: %d written to %s in %g s, %d stalls waiting %g s\n", c->written, c->filename, c->writeTime, c->stalls, c->stallTime );
+    pthread_cond_destroy( &c->done );
+    pthread_cond_destroy( &c->ready );
+    pthread_mutex_destroy( &c->lock );
+    free( c->copy );
+    free( c->filename );
+    free( c );
+}
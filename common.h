@@ -54,14 +54,21 @@ double read_timer( );
 //  simulation routines
 //
 void set_size( int n );
+void set_seed( long value );
+long get_seed( );
 void init_particles( int n, particle_t *p );
+int init_particles_in_cells( int n, int x0, int x1, int y0, int y1, particle_t *p );
 
 int getSizesteps();
 double getIntervall();
+double getSize();
+double getDt();
+int getCell(double coord);
 void initSquare(square_t *square);
 void clearSquare(square_t *previousSquare);
 void freeNodes(particle_node_t* destroyNode);
 void applyForces(particle_t *particle, square_t (**squares));
+void applyForcesWindow(particle_t *particle, square_t (**squares), int originX, int originY);
 
 void apply_force( particle_t &particle, particle_t &neighbor );
 void move( particle_t &p );
@@ -71,6 +78,7 @@ void move( particle_t &p );
 //
 FILE *open_save( char *filename, int n );
 void save( FILE *f, int n, particle_t *p );
+void writePositions( FILE *f, int n, const double *xy, int stride );
 
 //
 //  argument processing routines
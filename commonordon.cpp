@@ -6,7 +6,12 @@
 #include <math.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <charconv>
 #include "common.h"
+#include "phases.h"
 
 double size;
 double intervall;
@@ -79,49 +84,177 @@ double getIntervall(){
     return intervall;
 }
 
+double getSize(){
+    return size;
+}
+
+double getDt(){
+    return dt;
+}
+
+//
+//  cell index of a coordinate, a particle sitting exactly on the far wall
+//  belongs to the last cell
+//
+int getCell(double coord){
+    return min(static_cast<int>(std::floor(coord / intervall)), sizesteps - 1);
+}
+
+//
+//  counter based random numbers: every value is a hash of the seed and its
+//  index, so any process can generate any particle without the others
+//
+static unsigned long long seed;
+static bool seeded = false;
+
+void set_seed( long value )
+{
+    seed = (unsigned long long) value;
+    seeded = true;
+}
+
+long get_seed( )
+{
+    return (long) seed;
+}
+
+static unsigned long long mix( unsigned long long z )
+{
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double uniform( unsigned long long counter )
+{
+    return (mix( seed ^ mix( counter ) ) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+//
+//  random permutation of [0, n) that can be evaluated and inverted one
+//  index at a time: a Feistel network on the smallest power of four that
+//  holds n, walking the cycle until it lands inside [0, n)
+//
+static long long shuffle_site( long long v, long long n, bool inverse )
+{
+    int halfbits = 1;
+    while( (1LL << (2 * halfbits)) < n )
+        halfbits++;
+    unsigned long long mask = (1ULL << halfbits) - 1;
+    const int rounds = 4;
+
+    do
+    {
+        unsigned long long left = (unsigned long long)v >> halfbits, right = (unsigned long long)v & mask;
+        for( int r = 0; r < rounds; r++ )
+        {
+            int round = inverse ? rounds - 1 - r : r;
+            if( inverse )
+            {
+                unsigned long long previous = right;
+                right = left;
+                left = previous ^ (mix( seed ^ mix( ~(unsigned long long)round ) ^ right ) & mask);
+            }else {
+                unsigned long long next = left ^ (mix( seed ^ mix( ~(unsigned long long)round ) ^ right ) & mask);
+                left = right;
+                right = next;
+            }
+        }
+        v = (long long)((left << halfbits) | right);
+    } while( v >= n );
+    return v;
+}
+
+//
+//  particle i sits on lattice site shuffle_site(i) of an sx by sy lattice
+//  and gets random velocities within a bound
+//
+static void make_particle( long long i, long long k, int sx, int sy, particle_t &p )
+{
+    p.x = size*(1.+(k%sx))/(1+sx);
+    p.y = size*(1.+(k/sx))/(1+sy);
+    p.vx = uniform( 2*i ) * 2 - 1;
+    p.vy = uniform( 2*i + 1 ) * 2 - 1;
+    p.ax = p.ay = 0;
+}
+
 //
 //  Initialize the particle positions and velocities
 //
 void init_particles( int n, particle_t *p )
 {
-    srand48( time( NULL ) );
+    if( !seeded )
+        set_seed( time( NULL ) );
 
     int sx = (int)ceil(sqrt((double)n));
     int sy = (n+sx-1)/sx;
 
-    int *shuffle = (int*)malloc( n * sizeof(int) );
-    for( int i = 0; i < n; i++ )
-        shuffle[i] = i;
-
     for( int i = 0; i < n; i++ )
     {
         //
-        //  make sure particles are not spatially sorted
-        //
-        int j = lrand48()%(n-i);
-        int k = shuffle[j];
-        shuffle[j] = shuffle[n-i-1];
-
-        //
+        //  make sure particles are not spatially sorted,
         //  distribute particles evenly to ensure proper spacing
         //
-        p[i].x = size*(1.+(k%sx))/(1+sx);
-        p[i].y = size*(1.+(k/sx))/(1+sy);
+        make_particle( i, shuffle_site( i, n, false ), sx, sy, p[i] );
+    }
+}
 
-        //
-        //  assign random velocities within a bound
-        //
-        p[i].vx = drand48()*2-1;
-        p[i].vy = drand48()*2-1;
+//
+//  generate only the particles of the full configuration that lie in cells
+//  [x0, x1) x [y0, y1), returns how many there are; with p == NULL they
+//  are only counted
+//
+int init_particles_in_cells( int n, int x0, int x1, int y0, int y1, particle_t *p )
+{
+    if( !seeded )
+        set_seed( time( NULL ) );
+
+    int sx = (int)ceil(sqrt((double)n));
+    int sy = (n+sx-1)/sx;
+
+    //
+    //  lattice columns and rows inside the cell range
+    //
+    int c0 = sx, c1 = 0, r0 = sy, r1 = 0;
+    for( int c = 0; c < sx; c++ )
+    {
+        int cell = getCell( size*(1.+c)/(1+sx) );
+        if( cell >= x0 && cell < x1 ) { c0 = min( c0, c ); c1 = max( c1, c + 1 ); }
+    }
+    for( int r = 0; r < sy; r++ )
+    {
+        int cell = getCell( size*(1.+r)/(1+sy) );
+        if( cell >= y0 && cell < y1 ) { r0 = min( r0, r ); r1 = max( r1, r + 1 ); }
     }
-    free( shuffle );
+
+    int count = 0;
+    for( int r = r0; r < r1; r++ )
+        for( int c = c0; c < c1; c++ )
+        {
+            long long k = (long long)r * sx + c;
+            if( k >= n )
+                break;
+            if( p )
+                make_particle( shuffle_site( k, n, true ), k, sx, sy, p[count] );
+            count++;
+        }
+    return count;
 }
 
 void applyForces(particle_t *particle, square_t (**squares)){
+    applyForcesWindow(particle, squares, 0, 0);
+}
+
+//
+//  same as applyForces, for a grid that only covers the cells from
+//  (originX, originY) onwards, e.g. an MPI subdomain and its ghost layer
+//
+void applyForcesWindow(particle_t *particle, square_t (**squares), int originX, int originY){
     int x;
     int y;
-    x = static_cast<int>(std::floor(particle->x / intervall));
-    y = static_cast<int>(std::floor(particle->y / intervall));
+    x = getCell(particle->x);
+    y = getCell(particle->y);
     particle->ax = particle-> ay = 0;
     particle_node_t *temp;
 
@@ -133,16 +266,18 @@ void applyForces(particle_t *particle, square_t (**squares)){
     if(x < sizesteps - 1) maxX = x + 2; else maxX = sizesteps;
     if(y < sizesteps - 1) maxY = y + 2; else maxY = sizesteps;
 
+    int pairs = 0;
     for (int i = tempX; i < maxX; i++) {
         for (int j = tempY; j < maxY; j++) {
-            temp = squares[i][j].particles;
+            temp = squares[i - originX][j - originY].particles;
             while (temp != nullptr) {
                 apply_force(*particle, *temp->p);
                 temp = temp->next;
+                pairs++;
             }
         }
     }
-    //}
+    COUNT_PAIRS(pairs);
 }
 
 //
@@ -206,8 +341,109 @@ void save( FILE *f, int n, particle_t *p )
         fprintf( f, "%d %g\n", n, size );
         first = false;
     }
-    for( int i = 0; i < n; i++ )
-        fprintf( f, "%g %g\n", p[i].x, p[i].y );
+    writePositions( f, n, &p[0].x, sizeof(particle_t) / sizeof(double) );
+}
+
+//
+//  "%g %g\n" lines of positions, formatted by several threads into their
+//  own buffers; std::to_chars in the general format with precision 6 gives
+//  the characters of %g in the C locale
+//
+#define LINE_LENGTH 32
+#define LINES_PER_THREAD 16384
+
+typedef struct
+{
+    const double *xy;
+    int stride;
+    int first, last;
+    char *buffer;
+    size_t bytes;
+} format_chunk_t;
+
+static char *formatValue( char *out, double value )
+{
+    return std::to_chars( out, out + LINE_LENGTH / 2, value, std::chars_format::general, 6 ).ptr;
+}
+
+static void *formatChunk( void *arg )
+{
+    format_chunk_t *c = (format_chunk_t*) arg;
+    char *out = c->buffer;
+    for( int i = c->first; i < c->last; i++ )
+    {
+        const double *position = c->xy + (size_t)i * c->stride;
+        out = formatValue( out, position[0] );
+        *out++ = ' ';
+        out = formatValue( out, position[1] );
+        *out++ = '\n';
+    }
+    c->bytes = out - c->buffer;
+    return NULL;
+}
+
+//
+//  n positions, x at xy[0] and y at xy[1], the next one at xy[stride]; the
+//  chunks go out with a single writev behind what is buffered in f
+//
+void writePositions( FILE *f, int n, const double *xy, int stride )
+{
+    static int nthreads = 0, capacity = 0;
+    static format_chunk_t *chunks = NULL;
+    static pthread_t *threads = NULL;
+    static struct iovec *pieces = NULL;
+    if( !nthreads )
+    {
+        nthreads = max( (int)sysconf( _SC_NPROCESSORS_ONLN ), 1 );
+        chunks = (format_chunk_t*) calloc( nthreads, sizeof(format_chunk_t) );
+        threads = (pthread_t*) malloc( nthreads * sizeof(pthread_t) );
+        pieces = (struct iovec*) malloc( nthreads * sizeof(struct iovec) );
+    }
+
+    int used = min( nthreads, max( n / LINES_PER_THREAD, 1 ) );
+    int lines = ( n + used - 1 ) / used;
+    if( lines > capacity )
+    {
+        capacity = lines;
+        for( int t = 0; t < nthreads; t++ )
+            chunks[t].buffer = (char*) realloc( chunks[t].buffer, (size_t)capacity * LINE_LENGTH );
+    }
+    for( int t = 0; t < used; t++ )
+    {
+        chunks[t].xy = xy;
+        chunks[t].stride = stride;
+        chunks[t].first = min( t * lines, n );
+        chunks[t].last = min( ( t + 1 ) * lines, n );
+        if( t > 0 )
+            pthread_create( &threads[t], NULL, formatChunk, &chunks[t] );
+    }
+    formatChunk( &chunks[0] );
+    for( int t = 1; t < used; t++ )
+        pthread_join( threads[t], NULL );
+
+    fflush( f );
+    for( int t = 0; t < used; t++ )
+    {
+        pieces[t].iov_base = chunks[t].buffer;
+        pieces[t].iov_len = chunks[t].bytes;
+    }
+    int count = 0;
+    while( count < used )
+    {
+        ssize_t written = writev( fileno( f ), pieces + count, used - count );
+        if( written < 0 )
+        {
+            perror( "writev" );
+            return;
+        }
+        for( ; count < used && (size_t)written >= pieces[count].iov_len; count++ )
+            written -= pieces[count].iov_len;
+        if( count < used )
+        {
+            pieces[count].iov_base = (char*) pieces[count].iov_base + written;
+            pieces[count].iov_len -= written;
+        }
+    }
 }
 
 //
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "common.h"
+#include "trajectory.h"
+
+//
+//  converts a binary trajectory back into the text format save() writes,
+//  which is what visualize reads
+//
+int main( int argc, char **argv )
+{
+    if( find_option( argc, argv, "-h" ) >= 0 || find_option( argc, argv, "-i" ) < 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-i <filename> to specify the binary trajectory to read\n" );
+        printf( "-o <filename> to specify the text output file name (default: standard output)\n" );
+        return 0;
+    }
+
+    char *inname = read_string( argc, argv, "-i", NULL );
+    char *outname = read_string( argc, argv, "-o", NULL );
+
+    trajectory_reader_t *trajectory = openTrajectoryReader( inname );
+    if( !trajectory )
+        return 1;
+    const trajectory_header_t &header = trajectory->header;
+    if( header.counted )
+    {
+        fprintf( stderr, "%s has frames of varying size, which the text format cannot hold\n", inname );
+        closeTrajectoryReader( trajectory );
+        return 1;
+    }
+    FILE *fout = outname ? fopen( outname, "w" ) : stdout;
+    if( !fout )
+    {
+        fprintf( stderr, "cannot open %s\n", outname );
+        return 1;
+    }
+
+    int n = (int)header.n;
+    double *xy = (double*) malloc( 2 * max( n, 1 ) * sizeof(double) );
+    fprintf( fout, "%d %g\n", n, header.size );
+    for( int frame = 0; frame < header.frames; frame++ )
+    {
+        if( !readFrame( trajectory, frame, xy ) )
+        {
+            fprintf( stderr, "%s: frame %d is truncated\n", inname, frame );
+            break;
+        }
+        writePositions( fout, n, xy, 2 );
+    }
+    fprintf( stderr, "%d frames of %d particles, dt = %g, every %d steps, %s, positions within %g\n",
+             header.frames, n, header.dt, header.savefreq,
+             header.encoding == TRAJECTORY_DELTA ? "delta encoded" : header.precision == sizeof(float) ? "float" : "double",
+             trajectoryError( &header ) );
+
+    free( xy );
+    closeTrajectoryReader( trajectory );
+    if( fout != stdout )
+        fclose( fout );
+
+    return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef __CS267_DENSITY_H__
+#define __CS267_DENSITY_H__
+
+#include <stdio.h>
+#include "common.h"
+
+//
+//  density field file: a header, then per frame the step followed by
+//  cells x cells records (x major) with the number of particles in the
+//  cell and their mean velocity; every cell covers a block of the bins the
+//  force computation uses, so the field is collected while binning
+//
+const char DENSITY_MAGIC[8] = { 'C', 'S', '2', '6', '7', 'D', 'E', 'N' };
+const int DENSITY_VERSION = 1;
+
+typedef struct
+{
+    char magic[8];
+    int version;
+    int cells;
+    long long n;
+    double size;
+    double dt;
+    int savefreq;
+    int frames;
+} density_header_t;
+
+typedef struct
+{
+    unsigned int count;
+    float vx;
+    float vy;
+} density_cell_t;
+
+//
+//  sums of the frame being collected; f is NULL on MPI ranks that only
+//  contribute their particles to the one writing
+//
+typedef struct
+{
+    FILE *f;
+    density_header_t header;
+    int *cellOfBin;
+    unsigned int *count;
+    double *vx;
+    double *vy;
+    density_cell_t *frame;
+    long long bytes;
+} density_t;
+
+density_t *openDensity( const char *filename, int n, int cells );
+void clearDensity( density_t *d );
+void writeDensity( density_t *d, long long step );
+void closeDensity( density_t *d );
+
+//
+//  particle p in bin (bx, by)
+//
+inline void addToDensity( density_t *d, int bx, int by, const particle_t &p )
+{
+    int c = d->cellOfBin[bx] * d->header.cells + d->cellOfBin[by];
+    d->count[c]++;
+    d->vx[c] += p.vx;
+    d->vy[c] += p.vy;
+}
+
+#endif
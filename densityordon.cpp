@@ -0,0 +1,97 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "density.h"
+
+//
+//  at most one cell per bin; bins are split as evenly as possible among
+//  the cells
+//
+density_t *openDensity( const char *filename, int n, int cells )
+{
+    density_t *d = (density_t*) calloc( 1, sizeof(density_t) );
+    if( filename )
+    {
+        d->f = fopen( filename, "wb" );
+        if( !d->f )
+        {
+            fprintf( stderr, "cannot open %s\n", filename );
+            free( d );
+            return NULL;
+        }
+    }
+
+    int bins = getSizesteps( );
+    cells = min( max( cells, 1 ), bins );
+    density_header_t &h = d->header;
+    memcpy( h.magic, DENSITY_MAGIC, sizeof(DENSITY_MAGIC) );
+    h.version = DENSITY_VERSION;
+    h.cells = cells;
+    h.n = n;
+    h.size = getSize( );
+    h.dt = getDt( );
+    h.savefreq = SAVEFREQ;
+
+    d->cellOfBin = (int*) malloc( bins * sizeof(int) );
+    for( int b = 0; b < bins; b++ )
+        d->cellOfBin[b] = (int)( (long long)b * cells / bins );
+    d->count = (unsigned int*) malloc( cells * cells * sizeof(unsigned int) );
+    d->vx = (double*) malloc( cells * cells * sizeof(double) );
+    d->vy = (double*) malloc( cells * cells * sizeof(double) );
+    d->frame = (density_cell_t*) malloc( cells * cells * sizeof(density_cell_t) );
+    clearDensity( d );
+
+    if( d->f )
+        fwrite( &h, sizeof(density_header_t), 1, d->f );
+    return d;
+}
+
+void clearDensity( density_t *d )
+{
+    int cells = d->header.cells * d->header.cells;
+    memset( d->count, 0, cells * sizeof(unsigned int) );
+    memset( d->vx, 0, cells * sizeof(double) );
+    memset( d->vy, 0, cells * sizeof(double) );
+}
+
+//
+//  write the collected frame and start the next one
+//
+void writeDensity( density_t *d, long long step )
+{
+    if( d->f )
+    {
+        int cells = d->header.cells * d->header.cells;
+        for( int c = 0; c < cells; c++ )
+        {
+            d->frame[c].count = d->count[c];
+            d->frame[c].vx = d->count[c] ? (float)( d->vx[c] / d->count[c] ) : 0.0f;
+            d->frame[c].vy = d->count[c] ? (float)( d->vy[c] / d->count[c] ) : 0.0f;
+        }
+        fwrite( &step, sizeof(long long), 1, d->f );
+        fwrite( d->frame, sizeof(density_cell_t), cells, d->f );
+        d->header.frames++;
+        d->bytes += sizeof(long long) + cells * sizeof(density_cell_t);
+    }
+    clearDensity( d );
+}
+
+void closeDensity( density_t *d )
+{
+    if( d->f )
+    {
+        fseek( d->f, 0, SEEK_SET );
+        fwrite( &d->header, sizeof(density_header_t), 1, d->f );
+        fclose( d->f );
+
+        double positions = (double)d->header.frames * d->header.n * 2 * sizeof(double);
+        printf( "density field: %d frames of %d x %d cells, %g MB (%g:1 against double positions)\n",
+                d->header.frames, d->header.cells, d->header.cells, d->bytes / 1e6, d->bytes > 0 ? positions / d->bytes : 0.0 );
+    }
+    free( d->cellOfBin );
+    free( d->count );
+    free( d->vx );
+    free( d->vy );
+    free( d->frame );
+    free( d );
+}
@@ -0,0 +1,67 @@
+#ifndef __CS267_DIRECT_H__
+#define __CS267_DIRECT_H__
+
+#include <stddef.h>
+#include "common.h"
+
+//
+//  file written front to back with O_DIRECT through io_uring: the bytes
+//  are gathered in aligned buffers, every full buffer is submitted as one
+//  write at an aligned offset with up to depth writes in flight, and the
+//  file is preallocated with fallocate ahead of the writes; without
+//  io_uring (old kernels, seccomp) the buffers are written with pwrite, and
+//  where O_DIRECT is refused (tmpfs) through the page cache
+//
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUFFER ( 1 << 20 )
+#define DIRECT_EXTENT ( 64LL << 20 )
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+typedef struct
+{
+    int fd;
+    bool direct;
+    bool uring;
+    bool failed;
+
+    //
+    //  depth + 1 buffers, one being filled while the others are written
+    //
+    int depth;
+    char **buffers;
+    bool *busy;
+    int current;
+    size_t used;
+    long long offset;
+    long long bytes;
+    long long allocated;
+
+    //
+    //  submission and completion rings shared with the kernel unless
+    //  writing with pwrite
+    //
+    int ring;
+    void *sq, *cq;
+    size_t sqBytes, cqBytes;
+    struct io_uring_sqe *sqes;
+    size_t sqeBytes;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    long long *writeOffset;
+    size_t *writeLength;
+
+    int writes;
+    int inflight;
+    int maxInflight;
+    double waitTime;
+} direct_file_t;
+
+direct_file_t *openDirect( const char *filename, int depth );
+void appendDirect( direct_file_t *d, const void *data, size_t bytes );
+bool finishDirect( direct_file_t *d, const void *header, size_t headerBytes, bool sync );
+void freeDirect( direct_file_t *d );
+
+#endif
@@ -0,0 +1,311 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "direct.h"
+
+//
+//  io_uring without liburing: the two system calls and the rings mapped
+//  from the ring file descriptor
+//
+static int uringSetup( unsigned entries, struct io_uring_params *params )
+{
+#ifdef __NR_io_uring_setup
+    return (int) syscall( __NR_io_uring_setup, entries, params );
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int uringEnter( int ring, unsigned submit, unsigned complete, unsigned flags )
+{
+#ifdef __NR_io_uring_enter
+    return (int) syscall( __NR_io_uring_enter, ring, submit, complete, flags, NULL, 0 );
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static bool mapRing( direct_file_t *d )
+{
+    struct io_uring_params params;
+    memset( &params, 0, sizeof(params) );
+    d->ring = uringSetup( d->depth, &params );
+    if( d->ring < 0 )
+        return false;
+
+    d->sqBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    d->cqBytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if( single )
+        d->sqBytes = d->cqBytes = d->sqBytes > d->cqBytes ? d->sqBytes : d->cqBytes;
+    d->sqeBytes = params.sq_entries * sizeof(struct io_uring_sqe);
+    d->sq = mmap( NULL, d->sqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d->ring, IORING_OFF_SQ_RING );
+    d->cq = single ? d->sq : mmap( NULL, d->cqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d->ring, IORING_OFF_CQ_RING );
+    void *sqes = mmap( NULL, d->sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d->ring, IORING_OFF_SQES );
+    if( d->sq == MAP_FAILED || d->cq == MAP_FAILED || sqes == MAP_FAILED )
+    {
+        if( d->sq != MAP_FAILED )
+            munmap( d->sq, d->sqBytes );
+        if( !single && d->cq != MAP_FAILED )
+            munmap( d->cq, d->cqBytes );
+        if( sqes != MAP_FAILED )
+            munmap( sqes, d->sqeBytes );
+        close( d->ring );
+        d->ring = -1;
+        return false;
+    }
+
+    char *sq = (char*) d->sq, *cq = (char*) d->cq;
+    d->sqes = (struct io_uring_sqe*) sqes;
+    d->sqTail = (unsigned*)( sq + params.sq_off.tail );
+    d->sqMask = (unsigned*)( sq + params.sq_off.ring_mask );
+    d->sqArray = (unsigned*)( sq + params.sq_off.array );
+    d->cqHead = (unsigned*)( cq + params.cq_off.head );
+    d->cqTail = (unsigned*)( cq + params.cq_off.tail );
+    d->cqMask = (unsigned*)( cq + params.cq_off.ring_mask );
+    d->cqes = (struct io_uring_cqe*)( cq + params.cq_off.cqes );
+    return true;
+}
+
+static void unmapRing( direct_file_t *d )
+{
+    munmap( d->sqes, d->sqeBytes );
+    if( d->cq != d->sq )
+        munmap( d->cq, d->cqBytes );
+    munmap( d->sq, d->sqBytes );
+    close( d->ring );
+}
+
+//
+//  a write the ring could not do (or a short one) is done again with pwrite
+//
+static bool writeBuffer( direct_file_t *d, int buffer )
+{
+    const char *data = d->buffers[buffer];
+    size_t length = d->writeLength[buffer];
+    long long offset = d->writeOffset[buffer];
+    while( length > 0 )
+    {
+        ssize_t written = pwrite( d->fd, data, length, offset );
+        if( written < 0 && errno == EINTR )
+            continue;
+        if( written <= 0 )
+            return false;
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+static void completeWrite( direct_file_t *d, int buffer, int result )
+{
+    if( result != (int)d->writeLength[buffer] && !writeBuffer( d, buffer ) && !d->failed )
+    {
+        fprintf( stderr, "direct write of %zu bytes at %lld failed\n", d->writeLength[buffer], d->writeOffset[buffer] );
+        d->failed = true;
+    }
+    d->busy[buffer] = false;
+    d->inflight--;
+}
+
+//
+//  take the completed writes off the completion ring, waiting for at least
+//  one if wait is set
+//
+static void reapWrites( direct_file_t *d, bool wait )
+{
+    while( true )
+    {
+        unsigned head = *d->cqHead;
+        unsigned tail = __atomic_load_n( d->cqTail, __ATOMIC_ACQUIRE );
+        if( head == tail )
+        {
+            if( !wait )
+                return;
+            if( uringEnter( d->ring, 0, 1, IORING_ENTER_GETEVENTS ) < 0 && errno != EINTR )
+            {
+                fprintf( stderr, "io_uring_enter failed: %s\n", strerror( errno ) );
+                exit( 1 );
+            }
+            continue;
+        }
+        for( ; head != tail; head++ )
+        {
+            const struct io_uring_cqe *cqe = &d->cqes[head & *d->cqMask];
+            completeWrite( d, (int)cqe->user_data, cqe->res );
+        }
+        __atomic_store_n( d->cqHead, head, __ATOMIC_RELEASE );
+        return;
+    }
+}
+
+static void waitForBuffer( direct_file_t *d, int buffer )
+{
+    if( !d->busy[buffer] )
+        return;
+    double start = read_timer( );
+    while( d->busy[buffer] )
+        reapWrites( d, true );
+    d->waitTime += read_timer( ) - start;
+}
+
+//
+//  write the current buffer (length rounded up to DIRECT_ALIGN) at the
+//  current offset and move on to the next buffer
+//
+static void submitBuffer( direct_file_t *d, size_t length )
+{
+    while( d->offset + (long long)length > d->allocated )
+    {
+        fallocate( d->fd, FALLOC_FL_KEEP_SIZE, d->allocated, DIRECT_EXTENT );
+        d->allocated += DIRECT_EXTENT;
+    }
+
+    int buffer = d->current;
+    d->writeOffset[buffer] = d->offset;
+    d->writeLength[buffer] = length;
+    d->offset += length;
+    d->writes++;
+    if( !d->uring )
+    {
+        if( !writeBuffer( d, buffer ) && !d->failed )
+        {
+            fprintf( stderr, "write of %zu bytes at %lld failed\n", length, d->writeOffset[buffer] );
+            d->failed = true;
+        }
+    }else {
+        reapWrites( d, false );
+        unsigned tail = *d->sqTail;
+        unsigned index = tail & *d->sqMask;
+        struct io_uring_sqe *sqe = &d->sqes[index];
+        memset( sqe, 0, sizeof(*sqe) );
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = d->fd;
+        sqe->addr = (unsigned long long)(size_t) d->buffers[buffer];
+        sqe->len = (unsigned)length;
+        sqe->off = d->writeOffset[buffer];
+        sqe->user_data = buffer;
+        d->sqArray[index] = index;
+        __atomic_store_n( d->sqTail, tail + 1, __ATOMIC_RELEASE );
+        d->busy[buffer] = true;
+        d->inflight++;
+        d->maxInflight = max( d->maxInflight, d->inflight );
+        while( uringEnter( d->ring, 1, 0, 0 ) < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            if( errno == EAGAIN || errno == EBUSY )
+            {
+                reapWrites( d, true );
+                continue;
+            }
+            fprintf( stderr, "io_uring_enter failed: %s\n", strerror( errno ) );
+            exit( 1 );
+        }
+    }
+
+    d->current = ( d->current + 1 ) % ( d->depth + 1 );
+    d->used = 0;
+    waitForBuffer( d, d->current );
+}
+
+direct_file_t *openDirect( const char *filename, int depth )
+{
+    int fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644 );
+    bool direct = fd >= 0;
+    if( fd < 0 && errno == EINVAL )
+        fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 )
+        return NULL;
+
+    direct_file_t *d = (direct_file_t*) calloc( 1, sizeof(direct_file_t) );
+    d->fd = fd;
+    d->direct = direct;
+    d->depth = max( depth, 1 );
+    d->buffers = (char**) malloc( ( d->depth + 1 ) * sizeof(char*) );
+    d->busy = (bool*) calloc( d->depth + 1, sizeof(bool) );
+    d->writeOffset = (long long*) calloc( d->depth + 1, sizeof(long long) );
+    d->writeLength = (size_t*) calloc( d->depth + 1, sizeof(size_t) );
+    for( int i = 0; i <= d->depth; i++ )
+    {
+        void *buffer = NULL;
+        if( posix_memalign( &buffer, DIRECT_ALIGN, DIRECT_BUFFER ) != 0 )
+        {
+            fprintf( stderr, "cannot allocate %d direct I/O buffers\n", d->depth + 1 );
+            exit( 1 );
+        }
+        d->buffers[i] = (char*) buffer;
+    }
+    d->uring = mapRing( d );
+    return d;
+}
+
+void appendDirect( direct_file_t *d, const void *data, size_t bytes )
+{
+    const char *p = (const char*) data;
+    d->bytes += bytes;
+    while( bytes > 0 )
+    {
+        size_t part = DIRECT_BUFFER - d->used;
+        part = part < bytes ? part : bytes;
+        memcpy( d->buffers[d->current] + d->used, p, part );
+        d->used += part;
+        p += part;
+        bytes -= part;
+        if( d->used == DIRECT_BUFFER )
+            submitBuffer( d, DIRECT_BUFFER );
+    }
+}
+
+//
+//  write the rest, wait for all writes, cut the file to its length (the
+//  last write is padded to DIRECT_ALIGN) and overwrite its start with the
+//  header, which the reader only trusts once the rest is there; the
+//  statistics stay until freeDirect
+//
+bool finishDirect( direct_file_t *d, const void *header, size_t headerBytes, bool sync )
+{
+    if( d->used > 0 )
+    {
+        size_t length = ( d->used + DIRECT_ALIGN - 1 ) / DIRECT_ALIGN * DIRECT_ALIGN;
+        memset( d->buffers[d->current] + d->used, 0, length - d->used );
+        submitBuffer( d, length );
+    }
+    for( int i = 0; i <= d->depth; i++ )
+        waitForBuffer( d, i );
+
+    bool complete = !d->failed && ftruncate( d->fd, d->bytes ) == 0;
+    if( header && headerBytes > 0 )
+    {
+        if( d->direct )
+            fcntl( d->fd, F_SETFL, fcntl( d->fd, F_GETFL ) & ~O_DIRECT );
+        complete = pwrite( d->fd, header, headerBytes, 0 ) == (ssize_t)headerBytes && complete;
+    }
+    if( sync )
+        complete = fsync( d->fd ) == 0 && complete;
+    complete = close( d->fd ) == 0 && complete;
+    d->fd = -1;
+    if( d->uring )
+        unmapRing( d );
+    return complete;
+}
+
+void freeDirect( direct_file_t *d )
+{
+    for( int i = 0; i <= d->depth; i++ )
+        free( d->buffers[i] );
+    free( d->buffers );
+    free( d->busy );
+    free( d->writeOffset );
+    free( d->writeLength );
+    free( d );
+}
@@ -0,0 +1,242 @@
+#ifndef __CS267_DOMAIN_H__
+#define __CS267_DOMAIN_H__
+
+#include <mpi.h>
+#include "common.h"
+#include "trajectory.h"
+#include "checkpoint.h"
+#include "density.h"
+#include "selection.h"
+
+//
+//  the eight neighbouring subdomains, ordered so that the opposite
+//  direction of d is 7 - d
+//
+const int NEIGHBOURS = 8;
+const int neighbourDx[NEIGHBOURS] = { -1, -1, -1,  0, 0,  1, 1, 1 };
+const int neighbourDy[NEIGHBOURS] = { -1,  0,  1, -1, 1, -1, 0, 1 };
+
+//
+//  particle buffer that grows on demand
+//
+typedef struct
+{
+    particle_t *p;
+    int count;
+    int capacity;
+} particle_buffer_t;
+
+//
+//  ghost particles only need their positions for the force computation;
+//  GHOST_FLOAT sends them as a cell index plus float offsets from the cell
+//  origin (12 instead of 16 bytes, 48 for a full particle_t)
+//
+enum { GHOST_DOUBLE, GHOST_FLOAT };
+
+//
+//  ghosts travel either as point to point messages or as one
+//  MPI_Ineighbor_alltoallv over a graph of the eight neighbours
+//
+enum { EXCHANGE_POINT_TO_POINT, EXCHANGE_NEIGHBOURHOOD };
+
+typedef struct
+{
+    double x;
+    double y;
+} ghost_t;
+
+typedef struct
+{
+    float dx;
+    float dy;
+    int cell;
+} packed_ghost_t;
+
+typedef struct
+{
+    char *data;
+    int count;
+    int capacity;
+} record_buffer_t;
+
+//
+//  2D block decomposition of the cell grid across the ranks of a cartesian
+//  communicator; every rank owns the particles in its block of cells and
+//  keeps a layer of ghost cells around it
+//
+typedef struct
+{
+    MPI_Comm comm;
+    MPI_Datatype PARTICLE;
+    MPI_Datatype GHOST[2];
+    int ghostFormat;
+    int rank;
+    int n_proc;
+
+    //
+    //  process grid and the cell index where every process row/column starts
+    //
+    int dims[2];
+    int coords[2];
+    int *xcuts;
+    int *ycuts;
+    int neighbours[NEIGHBOURS];
+
+    //
+    //  neighbourhood collective backend: the existing neighbours in
+    //  direction order and the arguments of the transfer in flight
+    //
+    int exchangeBackend;
+    MPI_Comm graphComm;
+    int graphDegree;
+    int graphDirections[NEIGHBOURS];
+    int graphSendcounts[NEIGHBOURS], graphSenddispls[NEIGHBOURS];
+    int graphRecvcounts[NEIGHBOURS], graphRecvdispls[NEIGHBOURS];
+    char *graphSend;
+
+    //
+    //  owned cells are [x0, x1) x [y0, y1), the squares cover them plus
+    //  halo layers of ghost cells
+    //
+    int x0, x1, y0, y1;
+    int halo;
+    int originX, originY;
+    int width, height;
+    square_t **squares;
+    square_t **previousSquares;
+    int squareCounter;
+
+    particle_buffer_t local;
+    particle_buffer_t ghosts;
+    int *ghostCells;
+    particle_buffer_t send[NEIGHBOURS];
+    int recvcount[NEIGHBOURS];
+    record_buffer_t ghostSend[NEIGHBOURS];
+    record_buffer_t ghostRecv;
+    long long ghostBytes;
+
+    //
+    //  ghost exchange in flight, and how much of its time was exposed or
+    //  hidden behind the interior force computation
+    //
+    MPI_Request requests[2 * NEIGHBOURS];
+    int messagePeers[NEIGHBOURS];
+    int nrequests;
+    double posted;
+    double completed;
+    double exposedTime;
+    double hiddenTime;
+
+    //
+    //  work measured by the driver since the last rebalance, and what
+    //  rebalancing has cost so far; subdomains never get narrower than
+    //  minWidth cells
+    //
+    double forceTime;
+    double forceParticles;
+    int minWidth;
+    int rebalances;
+    double rebalanceTime;
+
+    //
+    //  neighbours on the same node publish their boundary particles in a
+    //  shared window instead of sending them; sharedPeer[k] is neighbour k's
+    //  segment or NULL if it is on another node
+    //
+    bool sharedHalos;
+    MPI_Comm nodeComm;
+    MPI_Win sharedWin;
+    char *sharedBase;
+    char *sharedPeer[NEIGHBOURS];
+    MPI_Aint sharedCapacity;
+    int sharedHalf;
+    long long sharedBytes;
+
+    //
+    //  trajectory written collectively with MPI-IO
+    //
+    MPI_File snapshotFile;
+    trajectory_t *snapshots;
+
+    //
+    //  checkpoint written with a nonblocking collective while the
+    //  simulation goes on, renamed into place once it completes
+    //
+    MPI_File checkpointFile;
+    MPI_Request checkpointRequest;
+    particle_buffer_t checkpointCopy;
+    char *checkpointName;
+    bool checkpointPending;
+    int checkpoints;
+    double checkpointTime;
+
+    //
+    //  density field collected while binning the owned particles, set by
+    //  the driver for the steps that are saved
+    //
+    density_t *density;
+
+    //
+    //  window cut out of the owned particles while binning them, set by the
+    //  driver for the steps that are saved
+    //
+    selection_t *selection;
+} domain_t;
+
+//
+//  setup and teardown
+//
+void initDomain( domain_t *d, MPI_Comm comm, MPI_Datatype PARTICLE );
+void freeDomain( domain_t *d );
+void reserveParticles( particle_buffer_t *b, int capacity );
+void pushParticle( particle_buffer_t *b, const particle_t &p );
+
+//
+//  ownership
+//
+int domainOwner( domain_t *d, int cx, int cy );
+bool ownsCell( domain_t *d, int cx, int cy );
+
+//
+//  communication and binning
+//
+void initLocalParticles( domain_t *d, int n );
+void gatherParticles( domain_t *d, particle_t *particles );
+int gatherSelected( domain_t *d, particle_t *p, int count, particle_t *particles );
+void openSnapshots( domain_t *d, const char *filename, int n, int precision );
+void writeSnapshot( domain_t *d, int step );
+void closeSnapshots( domain_t *d );
+void startDomainCheckpoint( domain_t *d, const char *filename, long long step, int n );
+void finishDomainCheckpoint( domain_t *d );
+void readDomainCheckpoint( domain_t *d, const char *filename, int n );
+void writeDomainDensity( domain_t *d, density_t *density, long long step );
+void printDomainPhases( domain_t *d );
+void writeDomainTrace( domain_t *d, const char *filename );
+void exchangeGhosts( domain_t *d );
+void startGhostExchange( domain_t *d );
+bool testGhostExchange( domain_t *d );
+void finishGhostExchange( domain_t *d );
+void enableSharedHalos( domain_t *d );
+void migrateParticles( domain_t *d );
+void redistributeParticles( domain_t *d );
+void rebalanceDomain( domain_t *d );
+void binDomain( domain_t *d );
+void binLocal( domain_t *d );
+void binGhosts( domain_t *d );
+
+//
+//  force computation by cell
+//
+void interiorCells( domain_t *d, int *ix0, int *ix1, int *iy0, int *iy1 );
+void applyForcesInCell( domain_t *d, int cx, int cy );
+
+//
+//  deep halos: several ghost layers of full particles, advanced redundantly
+//  so that the exchange is only needed every few steps
+//
+void setHaloDepth( domain_t *d, int depth );
+void exchangeDeepHalo( domain_t *d );
+void trimDeepHalo( domain_t *d );
+bool forcesInWindow( domain_t *d, int cx, int cy );
+
+#endif
@@ -0,0 +1,1199 @@
+#include <mpi.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <algorithm>
+#include "domain.h"
+#include "phases.h"
+
+//
+//  particle buffers
+//
+void reserveParticles( particle_buffer_t *b, int capacity )
+{
+    if( capacity <= b->capacity )
+        return;
+    b->capacity = max( capacity, 2 * b->capacity );
+    b->p = (particle_t*) realloc( b->p, b->capacity * sizeof(particle_t) );
+}
+
+void pushParticle( particle_buffer_t *b, const particle_t &p )
+{
+    reserveParticles( b, b->count + 1 );
+    b->p[b->count++] = p;
+}
+
+static void reserveRecords( record_buffer_t *b, int capacity, int recordSize )
+{
+    if( capacity <= b->capacity )
+        return;
+    b->capacity = max( capacity, 2 * b->capacity );
+    b->data = (char*) realloc( b->data, (size_t)b->capacity * recordSize );
+}
+
+static int directionOf( int dx, int dy )
+{
+    int d = (dx + 1) * 3 + (dy + 1);
+    return d > 4 ? d - 1 : d;
+}
+
+static void setupWindow( domain_t *d );
+
+//
+//  set up the process grid, the owned block of cells and the local squares
+//
+void initDomain( domain_t *d, MPI_Comm comm, MPI_Datatype PARTICLE )
+{
+    memset( d, 0, sizeof(domain_t) );
+    d->PARTICLE = PARTICLE;
+    d->halo = 1;
+    d->minWidth = 1;
+    d->sharedHalos = false;
+    MPI_Comm_size( comm, &d->n_proc );
+
+    MPI_Type_contiguous( 2, MPI_DOUBLE, &d->GHOST[GHOST_DOUBLE] );
+    int blocklengths[2] = { 2, 1 };
+    MPI_Aint displacements[2] = { offsetof( packed_ghost_t, dx ), offsetof( packed_ghost_t, cell ) };
+    MPI_Datatype types[2] = { MPI_FLOAT, MPI_INT };
+    MPI_Datatype packed;
+    MPI_Type_create_struct( 2, blocklengths, displacements, types, &packed );
+    MPI_Type_create_resized( packed, 0, sizeof(packed_ghost_t), &d->GHOST[GHOST_FLOAT] );
+    MPI_Type_free( &packed );
+    MPI_Type_commit( &d->GHOST[GHOST_DOUBLE] );
+    MPI_Type_commit( &d->GHOST[GHOST_FLOAT] );
+
+    int sizesteps = getSizesteps();
+    MPI_Dims_create( d->n_proc, 2, d->dims );
+    if( d->dims[0] > sizesteps || d->dims[1] > sizesteps )
+    {
+        int rank;
+        MPI_Comm_rank( comm, &rank );
+        if( rank == 0 )
+            fprintf( stderr, "%d x %d processes do not fit a grid of %d x %d cells\n", d->dims[0], d->dims[1], sizesteps, sizesteps );
+        MPI_Abort( comm, 1 );
+    }
+
+    //
+    //  let the MPI library renumber the ranks to fit the process grid onto
+    //  the machine; ranks in the cartesian communicator are row major
+    //
+    int periods[2] = { 0, 0 };
+    MPI_Cart_create( comm, 2, d->dims, periods, 1, &d->comm );
+    MPI_Comm_rank( d->comm, &d->rank );
+    MPI_Cart_coords( d->comm, d->rank, 2, d->coords );
+
+    d->xcuts = (int*) malloc( (d->dims[0] + 1) * sizeof(int) );
+    d->ycuts = (int*) malloc( (d->dims[1] + 1) * sizeof(int) );
+    for( int i = 0; i <= d->dims[0]; i++ )
+        d->xcuts[i] = (int)( (long)i * sizesteps / d->dims[0] );
+    for( int i = 0; i <= d->dims[1]; i++ )
+        d->ycuts[i] = (int)( (long)i * sizesteps / d->dims[1] );
+
+    for( int k = 0; k < NEIGHBOURS; k++ )
+    {
+        int px = d->coords[0] + neighbourDx[k];
+        int py = d->coords[1] + neighbourDy[k];
+        if( px < 0 || px >= d->dims[0] || py < 0 || py >= d->dims[1] )
+            d->neighbours[k] = MPI_PROC_NULL;
+        else
+            d->neighbours[k] = px * d->dims[1] + py;
+        d->messagePeers[k] = d->neighbours[k];
+    }
+
+    //
+    //  the same eight neighbours as a distributed graph for the
+    //  neighbourhood collectives
+    //
+    int existing[NEIGHBOURS];
+    d->graphDegree = 0;
+    for( int k = 0; k < NEIGHBOURS; k++ )
+        if( d->neighbours[k] != MPI_PROC_NULL )
+        {
+            d->graphDirections[d->graphDegree] = k;
+            existing[d->graphDegree++] = d->neighbours[k];
+        }
+    MPI_Dist_graph_create_adjacent( d->comm, d->graphDegree, existing, MPI_UNWEIGHTED, d->graphDegree, existing, MPI_UNWEIGHTED,
+                                    MPI_INFO_NULL, 0, &d->graphComm );
+
+    setupWindow( d );
+}
+
+//
+//  owned block of cells and the squares covering it and its ghost layer,
+//  taken from the current cuts
+//
+static void setupWindow( domain_t *d )
+{
+    int sizesteps = getSizesteps();
+    d->x0 = d->xcuts[d->coords[0]];
+    d->x1 = d->xcuts[d->coords[0] + 1];
+    d->y0 = d->ycuts[d->coords[1]];
+    d->y1 = d->ycuts[d->coords[1] + 1];
+    d->originX = max( d->x0 - d->halo, 0 );
+    d->originY = max( d->y0 - d->halo, 0 );
+    d->width = min( d->x1 + d->halo, sizesteps ) - d->originX;
+    d->height = min( d->y1 + d->halo, sizesteps ) - d->originY;
+
+    d->squareCounter = 0;
+    d->previousSquares = (square_t**) malloc( d->width * d->height * sizeof(square_t*) );
+    d->squares = (square_t**) malloc( d->width * sizeof(square_t*) );
+    for( int i = 0; i < d->width; i++ )
+    {
+        d->squares[i] = (square_t*) malloc( d->height * sizeof(square_t) );
+        for( int j = 0; j < d->height; j++ )
+            initSquare( &d->squares[i][j] );
+    }
+}
+
+static void freeWindow( domain_t *d )
+{
+    for( int i = 0; i < d->squareCounter; i++ )
+        clearSquare( d->previousSquares[i] );
+    for( int i = 0; i < d->width; i++ )
+        free( d->squares[i] );
+    free( d->squares );
+    free( d->previousSquares );
+}
+
+void freeDomain( domain_t *d )
+{
+    freeWindow( d );
+    if( d->sharedHalos )
+    {
+        MPI_Win_unlock_all( d->sharedWin );
+        MPI_Win_free( &d->sharedWin );
+        MPI_Comm_free( &d->nodeComm );
+    }
+    MPI_Comm_free( &d->graphComm );
+    MPI_Comm_free( &d->comm );
+    free( d->graphSend );
+    free( d->checkpointCopy.p );
+    free( d->checkpointName );
+    free( d->xcuts );
+    free( d->ycuts );
+    free( d->local.p );
+    free( d->ghosts.p );
+    free( d->ghostCells );
+    free( d->ghostRecv.data );
+    for( int k = 0; k < NEIGHBOURS; k++ )
+    {
+        free( d->send[k].p );
+        free( d->ghostSend[k].data );
+    }
+    MPI_Type_free( &d->GHOST[GHOST_DOUBLE] );
+    MPI_Type_free( &d->GHOST[GHOST_FLOAT] );
+}
+
+//
+//  rank owning cell (cx, cy)
+//
+int domainOwner( domain_t *d, int cx, int cy )
+{
+    int px = (int)( std::upper_bound( d->xcuts, d->xcuts + d->dims[0] + 1, cx ) - d->xcuts ) - 1;
+    int py = (int)( std::upper_bound( d->ycuts, d->ycuts + d->dims[1] + 1, cy ) - d->ycuts ) - 1;
+    return px * d->dims[1] + py;
+}
+
+bool ownsCell( domain_t *d, int cx, int cy )
+{
+    return cx >= d->x0 && cx < d->x1 && cy >= d->y0 && cy < d->y1;
+}
+
+//
+//  send the per-direction buffers to the neighbours and append whatever
+//  they send us to the given buffer
+//
+static void exchange( domain_t *d, particle_buffer_t *into )
+{
+    for( int k = 0; k < NEIGHBOURS; k++ )
+    {
+        d->recvcount[NEIGHBOURS - 1 - k] = 0;
+        MPI_Sendrecv( &d->send[k].count, 1, MPI_INT, d->neighbours[k], k,
+                      &d->recvcount[NEIGHBOURS - 1 - k], 1, MPI_INT, d->neighbours[NEIGHBOURS - 1 - k], k,
+                      d->comm, MPI_STATUS_IGNORE );
+    }
+
+    int total = into->count;
+    for( int k = 0; k < NEIGHBOURS; k++ )
+        total += d->recvcount[k];
+    reserveParticles( into, total );
+
+    int offsets[NEIGHBOURS];
+    offsets[0] = into->count;
+    for( int k = 1; k < NEIGHBOURS; k++ )
+        offsets[k] = offsets[k-1] + d->recvcount[k-1];
+
+    for( int k = 0; k < NEIGHBOURS; k++ )
+        MPI_Sendrecv( d->send[k].p, d->send[k].count, d->PARTICLE, d->neighbours[k], NEIGHBOURS + k,
+                      into->p + offsets[NEIGHBOURS - 1 - k], d->recvcount[NEIGHBOURS - 1 - k], d->PARTICLE, d->neighbours[NEIGHBOURS - 1 - k], NEIGHBOURS + k,
+                      d->comm, MPI_STATUS_IGNORE );
+
+    into->count = total;
+}
+
+//
+//  bytes of one ghost record in the current ghost format
+//
+static int ghostRecordSize( domain_t *d )
+{
+    return d->ghostFormat == GHOST_FLOAT ? sizeof(packed_ghost_t) : sizeof(ghost_t);
+}
+
+//
+//  append a particle of cell (cx, cy) to a buffer of ghost records
+//
+static void pushGhost( domain_t *d, record_buffer_t *b, const particle_t &p, int cx, int cy )
+{
+    reserveRecords( b, b->count + 1, ghostRecordSize( d ) );
+    if( d->ghostFormat == GHOST_FLOAT )
+    {
+        packed_ghost_t *g = (packed_ghost_t*) b->data + b->count++;
+        g->dx = (float)( p.x - cx * getIntervall( ) );
+        g->dy = (float)( p.y - cy * getIntervall( ) );
+        g->cell = cx * getSizesteps( ) + cy;
+    }else {
+        ghost_t *g = (ghost_t*) b->data + b->count++;
+        g->x = p.x;
+        g->y = p.y;
+    }
+}
+
+//
+//  turn the received records into particles and remember their cells, a
+//  quantized position may round onto the next cell so the sender's cell is
+//  used for binning
+//
+static void unpackGhosts( domain_t *d )
+{
+    int count = d->ghostRecv.count;
+    reserveParticles( &d->ghosts, count );
+    d->ghosts.count = count;
+    d->ghostCells = (int*) realloc( d->ghostCells, max( d->ghosts.capacity, 1 ) * sizeof(int) );
+    memset( d->ghosts.p, 0, count * sizeof(particle_t) );
+
+    int sizesteps = getSizesteps( );
+    double interval = getIntervall( );
+    for( int i = 0; i < count; i++ )
+    {
+        particle_t &p = d->ghosts.p[i];
+        if( d->ghostFormat == GHOST_FLOAT )
+        {
+            packed_ghost_t *g = (packed_ghost_t*) d->ghostRecv.data + i;
+            int cx = g->cell / sizesteps, cy = g->cell % sizesteps;
+            p.x = cx * interval + g->dx;
+            p.y = cy * interval + g->dy;
+            d->ghostCells[i] = g->cell;
+        }else {
+            ghost_t *g = (ghost_t*) d->ghostRecv.data + i;
+            p.x = g->x;
+            p.y = g->y;
+            d->ghostCells[i] = getCell( p.x ) * sizesteps + getCell( p.y );
+        }
+    }
+}
+
+//
+//  shared window segments hold two halves, used on alternate steps, each
+//  with the counts for the eight directions followed by the records; with
+//  two halves a rank can write the next step while a slower neighbour
+//  still reads the last one, so one node barrier per step suffices
+//
+static const MPI_Aint SHARED_HEADER = NEIGHBOURS * sizeof(int);
+
+static char *sharedHalf( domain_t *d, char *segment, int half )
+{
+    return segment + half * ( SHARED_HEADER + d->sharedCapacity );
+}
+
+static char *sharedRecords( domain_t *d, char *segment, int direction )
+{
+    char *half = sharedHalf( d, segment, d->sharedHalf );
+    int *counts = (int*) half;
+    size_t offset = 0;
+    for( int k = 0; k < direction; k++ )
+        offset += (size_t)counts[k] * ghostRecordSize( d );
+    return half + SHARED_HEADER + offset;
+}
+
+static void allocateSharedWindow( domain_t *d, MPI_Aint capacity )
+{
+    d->sharedCapacity = capacity;
+    MPI_Win_allocate_shared( 2 * ( SHARED_HEADER + capacity ), 1, MPI_INFO_NULL, d->nodeComm, &d->sharedBase, &d->sharedWin );
+    MPI_Win_lock_all( MPI_MODE_NOCHECK, d->sharedWin );
+
+    MPI_Group group, nodeGroup;
+    MPI_Comm_group( d->comm, &group );
+    MPI_Comm_group( d->nodeComm, &nodeGroup );
+    for( int k = 0; k < NEIGHBOURS; k++ )
+    {
+        d->sharedPeer[k] = NULL;
+        d->messagePeers[k] = d->neighbours[k];
+        if( d->neighbours[k] == MPI_PROC_NULL )
+            continue;
+
+        int nodeRank;
+        MPI_Group_translate_ranks( group, 1, &d->neighbours[k], nodeGroup, &nodeRank );
+        if( nodeRank == MPI_UNDEFINED )
+            continue;
+
+        MPI_Aint size;
+        int unit;
+        MPI_Win_shared_query( d->sharedWin, nodeRank, &size, &unit, &d->sharedPeer[k] );
+        d->messagePeers[k] = MPI_PROC_NULL;
+    }
+    MPI_Group_free( &group );
+    MPI_Group_free( &nodeGroup );
+}
+
+//
+//  find the ranks on this node and exchange ghosts with those that are
+//  neighbours through shared memory from now on
+//
+void enableSharedHalos( domain_t *d )
+{
+    MPI_Comm_split_type( d->comm, MPI_COMM_TYPE_SHARED, d->rank, MPI_INFO_NULL, &d->nodeComm );
+    d->sharedHalos = true;
+    d->sharedHalf = 0;
+    allocateSharedWindow( d, 1 << 16 );
+}
+
+//
+//  write this step's boundary particles for the neighbours on this node
+//  and read the counts they wrote for us
+//
+static void publishSharedGhosts( domain_t *d )
+{
+    int recordSize = ghostRecordSize( d );
+    MPI_Aint needed = 0, largest;
+    for( int k = 0; k < NEIGHBOURS; k++ )
+        if( d->sharedPeer[k] )
+            needed += (MPI_Aint)d->ghostSend[k].count * recordSize;
+
+    //
+    //  all ranks on the node have finished reading the last step once they
+    //  get here, so the window can be replaced if anybody outgrew it
+    //
+    MPI_Allreduce( &needed, &largest, 1, MPI_AINT, MPI_MAX, d->nodeComm );
+    if( largest > d->sharedCapacity )
+    {
+        MPI_Win_unlock_all( d->sharedWin );
+        MPI_Win_free( &d->sharedWin );
+        allocateSharedWindow( d, max( 2 * d->sharedCapacity, largest ) );
+    }
+
+    d->sharedHalf = 1 - d->sharedHalf;
+    char *half = sharedHalf( d, d->sharedBase, d->sharedHalf );
+    int *counts = (int*) half;
+    char *records = half + SHARED_HEADER;
+    for( int k = 0; k < NEIGHBOURS; k++ )
+    {
+        counts[k] = d->sharedPeer[k] ? d->ghostSend[k].count : 0;
+        memcpy( records, d->ghostSend[k].data, (size_t)counts[k] * recordSize );
+        records += (size_t)counts[k] * recordSize;
+    }
+
+    MPI_Win_sync( d->sharedWin );
+    MPI_Barrier( d->nodeComm );
+    MPI_Win_sync( d->sharedWin );
+
+    for( int k = 0; k < NEIGHBOURS; k++ )
+        if( d->sharedPeer[k] )
+            d->recvcount[k] = ( (int*) sharedHalf( d, d->sharedPeer[k], d->sharedHalf ) )[NEIGHBOURS - 1 - k];
+}
+
+//
+//  the same transfer as one nonblocking neighbourhood collective, which
+//  leaves it to the MPI library to schedule and aggregate the messages
+//
+static void startNeighbourExchange( domain_t *d )
+{
+    int recordSize = ghostRecordSize( d );
+    double start = MPI_Wtime( );
+    int sendtotal = 0;
+    for( int i = 0; i < d->graphDegree; i++ )
+    {
+        d->graphSendcounts[i] = d->ghostSend[d->graphDirections[i]].count;
+        d->graphSenddispls[i] = sendtotal;
+        sendtotal += d->graphSendcounts[i];
+    }
+    MPI_Neighbor_alltoall( d->graphSendcounts, 1, MPI_INT, d->graphRecvcounts, 1, MPI_INT, d->graphComm );
+    d->exposedTime += MPI_Wtime( ) - start;
+
+    for( int k = 0; k < NEIGHBOURS; k++ )
+        d->recvcount[k] = 0;
+    for( int i = 0; i < d->graphDegree; i++ )
+        d->recvcount[d->graphDirections[i]] = d->graphRecvcounts[i];
+
+    //
+    //  the receive segments come in direction order, as with point to point
+    //
+    int total = 0;
+    for( int i = 0; i < d->graphDegree; i++ )
+    {
+        d->graphRecvdispls[i] = total;
+        total += d->graphRecvcounts[i];
+    }
+    reserveRecords( &d->ghostRecv, total, recordSize );
+    d->ghostRecv.count = total;
+
+    d->graphSend = (char*) realloc( d->graphSend, max( sendtotal, 1 ) * (size_t)recordSize );
+    for( int i = 0; i < d->graphDegree; i++ )
+        memcpy( d->graphSend + (size_t)d->graphSenddispls[i] * recordSize, d->ghostSend[d->graphDirections[i]].data, (size_t)d->graphSendcounts[i] * recordSize );
+    d->ghostBytes += (long long)sendtotal * recordSize;
+
+    MPI_Datatype GHOST = d->GHOST[d->ghostFormat];
+    MPI_Ineighbor_alltoallv( d->graphSend, d->graphSendcounts, d->graphSenddispls, GHOST,
+                             d->ghostRecv.data, d->graphRecvcounts, d->graphRecvdispls, GHOST, d->graphComm, &d->requests[0] );
+    d->nrequests = 1;
+    d->posted = MPI_Wtime( );
+    d->completed = -1;
+    testGhostExchange( d );
+}
+
+//
+//  copy the particles in the boundary cells to every neighbour that has
+//  those cells in its ghost layer, the data transfer is left in flight
+//  until finishGhostExchange
+//
+void startGhostExchange( domain_t *d )
+{
+    for( int k = 0; k < NEIGHBOURS; k++ )
+        d->ghostSend[k].count = 0;
+
+    for( int i = 0; i < d->local.count; i++ )
+    {
+        int cx = getCell( d->local.p[i].x );
+        int cy = getCell( d->local.p[i].y );
+        int xs[3], ys[3];
+        int nx = 0, ny = 0;
+        xs[nx++] = 0;
+        ys[ny++] = 0;
+        if( cx == d->x0 ) xs[nx++] = -1;
+        if( cx == d->x1 - 1 ) xs[nx++] = 1;
+        if( cy == d->y0 ) ys[ny++] = -1;
+        if( cy == d->y1 - 1 ) ys[ny++] = 1;
+
+        for( int a = 0; a < nx; a++ )
+            for( int b = 0; b < ny; b++ )
+            {
+                if( xs[a] == 0 && ys[b] == 0 )
+                    continue;
+                int k = directionOf( xs[a], ys[b] );
+                if( d->neighbours[k] != MPI_PROC_NULL )
+                    pushGhost( d, &d->ghostSend[k], d->local.p[i], cx, cy );
+            }
+    }
+
+    if( d->exchangeBackend == EXCHANGE_NEIGHBOURHOOD )
+    {
+        startNeighbourExchange( d );
+        return;
+    }
+
+    //
+    //  the counts have to arrive before the receives can be posted, this
+    //  small handshake is always exposed; neighbours on this node publish
+    //  their counts and particles in the shared window instead
+    //
+    double start = MPI_Wtime( );
+    if( d->sharedHalos )
+        publishSharedGhosts( d );
+    int nrequests = 0;
+    for( int k = 0; k < NEIGHBOURS; k++ )
+    {
+        if( !d->sharedPeer[k] )
+            d->recvcount[k] = 0;
+        MPI_Irecv( &d->recvcount[k], 1, MPI_INT, d->messagePeers[k], NEIGHBOURS - 1 - k, d->comm, &d->requests[nrequests++] );
+    }
+    for( int k = 0; k < NEIGHBOURS; k++ )
+        MPI_Isend( &d->ghostSend[k].count, 1, MPI_INT, d->messagePeers[k], k, d->comm, &d->requests[nrequests++] );
+    MPI_Waitall( nrequests, d->requests, MPI_STATUSES_IGNORE );
+    d->exposedTime += MPI_Wtime( ) - start;
+
+    int total = 0;
+    for( int k = 0; k < NEIGHBOURS; k++ )
+        total += d->recvcount[k];
+    int recordSize = ghostRecordSize( d );
+    reserveRecords( &d->ghostRecv, total, recordSize );
+    d->ghostRecv.count = total;
+
+    MPI_Datatype GHOST = d->GHOST[d->ghostFormat];
+    nrequests = 0;
+    for( int k = 0, offset = 0; k < NEIGHBOURS; offset += d->recvcount[k], k++ )
+    {
+        char *into = d->ghostRecv.data + (size_t)offset * recordSize;
+        if( d->sharedPeer[k] )
+        {
+            memcpy( into, sharedRecords( d, d->sharedPeer[k], NEIGHBOURS - 1 - k ), (size_t)d->recvcount[k] * recordSize );
+            d->sharedBytes += (long long)d->recvcount[k] * recordSize;
+        }else {
+            MPI_Irecv( into, d->recvcount[k], GHOST, d->messagePeers[k], NEIGHBOURS + NEIGHBOURS - 1 - k, d->comm, &d->requests[nrequests++] );
+        }
+    }
+    for( int k = 0; k < NEIGHBOURS; k++ )
+    {
+        MPI_Isend( d->ghostSend[k].data, d->sharedPeer[k] ? 0 : d->ghostSend[k].count, GHOST, d->messagePeers[k], NEIGHBOURS + k, d->comm, &d->requests[nrequests++] );
+        if( !d->sharedPeer[k] )
+            d->ghostBytes += (long long)d->ghostSend[k].count * recordSize;
+    }
+    d->nrequests = nrequests;
+    d->posted = MPI_Wtime( );
+    d->completed = -1;
+    testGhostExchange( d );
+}
+
+//
+//  poll the ghost transfer while computing, which also drives progress in
+//  MPI libraries without an asynchronous progress thread
+//
+bool testGhostExchange( domain_t *d )
+{
+    if( d->completed >= 0 )
+        return true;
+    int flag;
+    MPI_Testall( d->nrequests, d->requests, &flag, MPI_STATUSES_IGNORE );
+    if( flag )
+        d->completed = MPI_Wtime( );
+    return flag != 0;
+}
+
+//
+//  block until the ghosts are in, time spent here is exposed communication,
+//  time the transfer was in flight before that was hidden behind computation
+//
+void finishGhostExchange( domain_t *d )
+{
+    double start = MPI_Wtime( );
+    if( d->completed < 0 )
+        MPI_Waitall( d->nrequests, d->requests, MPI_STATUSES_IGNORE );
+    double end = MPI_Wtime( );
+    d->exposedTime += end - start;
+    d->hiddenTime += ( d->completed >= 0 ? d->completed : start ) - d->posted;
+    d->nrequests = 0;
+    unpackGhosts( d );
+}
+
+void exchangeGhosts( domain_t *d )
+{
+    startGhostExchange( d );
+    finishGhostExchange( d );
+}
+
+//
+//  hand particles that left the subdomain to their new owner, they can
+//  move at most into a neighbouring subdomain per step
+//
+void migrateParticles( domain_t *d )
+{
+    for( int k = 0; k < NEIGHBOURS; k++ )
+        d->send[k].count = 0;
+
+    int kept = 0;
+    for( int i = 0; i < d->local.count; i++ )
+    {
+        particle_t &p = d->local.p[i];
+        int cx = getCell( p.x );
+        int cy = getCell( p.y );
+        if( ownsCell( d, cx, cy ) )
+        {
+            d->local.p[kept++] = p;
+            continue;
+        }
+
+        int owner = domainOwner( d, cx, cy );
+        int dx = owner / d->dims[1] - d->coords[0];
+        int dy = owner % d->dims[1] - d->coords[1];
+        if( abs( dx ) > 1 || abs( dy ) > 1 )
+        {
+            fprintf( stderr, "rank %d: particle at (%g, %g) skipped past its neighbouring subdomains\n", d->rank, p.x, p.y );
+            MPI_Abort( d->comm, 1 );
+        }
+        pushParticle( &d->send[directionOf( dx, dy )], p );
+    }
+    d->local.count = kept;
+
+    exchange( d, &d->local );
+}
+
+//
+//  put owned and ghost particles into the local squares
+//
+static void putInSquare( domain_t *d, particle_t *particle, int cx, int cy )
+{
+    int x = cx - d->originX;
+    int y = cy - d->originY;
+
+    particle_node_t * ny;
+    ny = (particle_node_t*) malloc( sizeof(particle_node_t) );
+    ny->p = particle;
+
+    if( d->squares[x][y].particles == nullptr )
+    {
+        ny->next = nullptr;
+        d->squares[x][y].occupied = true;
+        d->previousSquares[d->squareCounter++] = &d->squares[x][y];
+    }else {
+        ny->next = d->squares[x][y].particles;
+    }
+    d->squares[x][y].particles = ny;
+}
+
+//
+//  the owned particles in the window, from the squares that overlap it (and
+//  their neighbours, as for the shared memory drivers); nothing to look at
+//  on ranks whose squares miss it
+//
+static void selectLocal( domain_t *d, selection_t *s )
+{
+    s->count = 0;
+    int cx0 = max( s->cx0, d->originX ), cx1 = min( s->cx1, d->originX + d->width );
+    int cy0 = max( s->cy0, d->originY ), cy1 = min( s->cy1, d->originY + d->height );
+    if( cx0 >= cx1 || cy0 >= cy1 )
+        return;
+    for( int cx = cx0; cx < cx1; cx++ )
+        for( int cy = cy0; cy < cy1; cy++ )
+            for( particle_node_t *node = d->squares[cx - d->originX][cy - d->originY].particles; node != nullptr; node = node->next )
+                if( inWindow( s, *node->p ) )
+                    s->p[s->count++] = *node->p;
+}
+
+void binLocal( domain_t *d )
+{
+    for( int i = 0; i < d->squareCounter; i++ )
+        clearSquare( d->previousSquares[i] );
+    d->squareCounter = 0;
+
+    for( int i = 0; i < d->local.count; i++ )
+    {
+        int cx = getCell( d->local.p[i].x ), cy = getCell( d->local.p[i].y );
+        putInSquare( d, &d->local.p[i], cx, cy );
+        if( d->density )
+            addToDensity( d->density, cx, cy, d->local.p[i] );
+    }
+    if( d->selection )
+        selectLocal( d, d->selection );
+}
+
+void binGhosts( domain_t *d )
+{
+    int sizesteps = getSizesteps( );
+    for( int i = 0; i < d->ghosts.count; i++ )
+        putInSquare( d, &d->ghosts.p[i], d->ghostCells[i] / sizesteps, d->ghostCells[i] % sizesteps );
+}
+
+void binDomain( domain_t *d )
+{
+    binLocal( d );
+    binGhosts( d );
+}
+
+//
+//  owned cells whose neighbourhood contains no ghost cells, the forces on
+//  their particles can be computed before the ghosts arrive
+//
+void interiorCells( domain_t *d, int *ix0, int *ix1, int *iy0, int *iy1 )
+{
+    *ix0 = d->x0 + ( d->x0 > 0 ? 1 : 0 );
+    *ix1 = max( d->x1 - ( d->x1 < getSizesteps() ? 1 : 0 ), *ix0 );
+    *iy0 = d->y0 + ( d->y0 > 0 ? 1 : 0 );
+    *iy1 = max( d->y1 - ( d->y1 < getSizesteps() ? 1 : 0 ), *iy0 );
+}
+
+void applyForcesInCell( domain_t *d, int cx, int cy )
+{
+    particle_node_t *temp = d->squares[cx - d->originX][cy - d->originY].particles;
+    while( temp != nullptr )
+    {
+        applyForcesWindow( temp->p, d->squares, d->originX, d->originY );
+        temp = temp->next;
+    }
+}
+
+//
+//  every rank generates the particles of the global configuration that
+//  start in its own subdomain
+//
+void initLocalParticles( domain_t *d, int n )
+{
+    int nlocal = init_particles_in_cells( n, d->x0, d->x1, d->y0, d->y1, NULL );
+    reserveParticles( &d->local, max( nlocal, 1 ) );
+    d->local.count = init_particles_in_cells( n, d->x0, d->x1, d->y0, d->y1, d->local.p );
+}
+
+//
+//  collect all particles on rank 0, in no particular order
+//
+void gatherParticles( domain_t *d, particle_t *particles )
+{
+    gatherSelected( d, d->local.p, d->local.count, particles );
+}
+
+//
+//  collect count particles of every rank on rank 0, returns how many there
+//  are on rank 0
+//
+int gatherSelected( domain_t *d, particle_t *p, int count, particle_t *particles )
+{
+    int *counts = NULL, *offsets = NULL, total = 0;
+    if( d->rank == 0 )
+    {
+        counts = (int*) malloc( d->n_proc * sizeof(int) );
+        offsets = (int*) malloc( d->n_proc * sizeof(int) );
+    }
+    MPI_Gather( &count, 1, MPI_INT, counts, 1, MPI_INT, 0, d->comm );
+    if( d->rank == 0 )
+    {
+        offsets[0] = 0;
+        for( int r = 1; r < d->n_proc; r++ )
+            offsets[r] = offsets[r-1] + counts[r-1];
+        total = offsets[d->n_proc-1] + counts[d->n_proc-1];
+    }
+    MPI_Gatherv( p, count, d->PARTICLE, particles, counts, offsets, d->PARTICLE, 0, d->comm );
+
+    free( offsets );
+    free( counts );
+    return total;
+}
+
+//
+//  trajectory written collectively with MPI-IO: every rank writes the
+//  positions of its particles at the offset of its slice of the frame, so
+//  no rank ever holds more than its own subdomain; all ranks keep the frame
+//  index, rank 0 writes it and the header
+//
+void openSnapshots( domain_t *d, const char *filename, int n, int precision )
+{
+    MPI_File_open( d->comm, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &d->snapshotFile );
+    MPI_File_set_size( d->snapshotFile, 0 );
+    d->snapshots = newTrajectory( n, precision );
+    MPI_File_write_at_all( d->snapshotFile, 0, &d->snapshots->header, d->rank == 0 ? sizeof(trajectory_header_t) : 0, MPI_BYTE, MPI_STATUS_IGNORE );
+}
+
+void writeSnapshot( domain_t *d, int step )
+{
+    trajectory_t *t = d->snapshots;
+    long long count = d->local.count, first = 0;
+    MPI_Exscan( &count, &first, 1, MPI_LONG_LONG, MPI_SUM, d->comm );
+    if( d->rank == 0 )
+        first = 0;
+
+    size_t bytes = packFrame( t, d->local.count, d->local.p );
+    MPI_Offset offset = t->end + first * 2 * t->header.precision;
+    MPI_File_write_at_all( d->snapshotFile, offset, t->buffer, (int)bytes, MPI_BYTE, MPI_STATUS_IGNORE );
+    indexFrame( t, step, t->header.n * 2 * t->header.precision );
+}
+
+void closeSnapshots( domain_t *d )
+{
+    trajectory_t *t = d->snapshots;
+    t->header.indexOffset = t->end;
+    if( d->rank == 0 )
+    {
+        MPI_File_write_at( d->snapshotFile, t->end, t->index, t->header.frames * sizeof(trajectory_frame_t), MPI_BYTE, MPI_STATUS_IGNORE );
+        MPI_File_write_at( d->snapshotFile, 0, &t->header, sizeof(trajectory_header_t), MPI_BYTE, MPI_STATUS_IGNORE );
+    }
+    MPI_File_close( &d->snapshotFile );
+    freeTrajectory( t );
+    d->snapshots = NULL;
+}
+
+//
+//  sum the density fields of all ranks on rank 0, which writes the frame
+//
+void writeDomainDensity( domain_t *d, density_t *density, long long step )
+{
+    int cells = density->header.cells * density->header.cells;
+    bool root = d->rank == 0;
+    MPI_Reduce( root ? MPI_IN_PLACE : density->count, density->count, cells, MPI_UNSIGNED, MPI_SUM, 0, d->comm );
+    MPI_Reduce( root ? MPI_IN_PLACE : density->vx, density->vx, cells, MPI_DOUBLE, MPI_SUM, 0, d->comm );
+    MPI_Reduce( root ? MPI_IN_PLACE : density->vy, density->vy, cells, MPI_DOUBLE, MPI_SUM, 0, d->comm );
+    writeDensity( density, step );
+}
+
+//
+//  phase breakdown over the timers of all ranks (and their threads),
+//  printed by rank 0 if the timers are compiled in
+//
+void printDomainPhases( domain_t *d )
+{
+#ifdef PHASE_TIMERS
+    double local[3][PHASES], global[3][PHASES];
+    phaseStatistics( local[0], local[1], local[2] );
+    MPI_Reduce( local[0], global[0], PHASES, MPI_DOUBLE, MPI_MIN, 0, d->comm );
+    MPI_Reduce( local[1], global[1], PHASES, MPI_DOUBLE, MPI_SUM, 0, d->comm );
+    MPI_Reduce( local[2], global[2], PHASES, MPI_DOUBLE, MPI_MAX, 0, d->comm );
+    int timers;
+    MPI_Reduce( &phaseThreads, &timers, 1, MPI_INT, MPI_SUM, 0, d->comm );
+    const char *unit = timers > d->n_proc ? "threads" : "ranks";
+    if( d->rank == 0 )
+        printPhaseStatistics( global[0], global[1], global[2], timers, unit );
+    if( phaseCounters )
+    {
+        double counters[PHASES * ( COUNTERS + 1 )], totals[PHASES * ( COUNTERS + 1 )];
+        counterTotals( counters );
+        MPI_Reduce( counters, totals, PHASES * ( COUNTERS + 1 ), MPI_DOUBLE, MPI_SUM, 0, d->comm );
+        if( d->rank == 0 )
+            printCounterTotals( totals, timers, unit );
+    }
+#else
+    (void)d;
+#endif
+}
+
+//
+//  events of all ranks gathered on rank 0, which writes them with one
+//  timeline per rank; the ranks start their traces after a barrier, so
+//  their clocks agree to within its skew
+//
+void writeDomainTrace( domain_t *d, const char *filename )
+{
+    MPI_Datatype EVENT;
+    MPI_Type_contiguous( sizeof(phase_event_t), MPI_BYTE, &EVENT );
+    MPI_Type_commit( &EVENT );
+
+    phase_event_t *events;
+    int count = collectTraceEvents( &events );
+    bool root = d->rank == 0;
+    int *counts = root ? (int*) malloc( d->n_proc * sizeof(int) ) : NULL;
+    int *offsets = root ? (int*) malloc( d->n_proc * sizeof(int) ) : NULL;
+    MPI_Gather( &count, 1, MPI_INT, counts, 1, MPI_INT, 0, d->comm );
+    long long total = 0;
+    if( root )
+        for( int r = 0; r < d->n_proc; r++ )
+        {
+            offsets[r] = (int)total;
+            total += counts[r];
+        }
+    phase_event_t *all = root ? (phase_event_t*) malloc( ( total > 0 ? total : 1 ) * sizeof(phase_event_t) ) : NULL;
+    MPI_Gatherv( events, count, EVENT, all, counts, offsets, EVENT, 0, d->comm );
+    MPI_Type_free( &EVENT );
+
+    trace_file_t *trace = root ? openTraceFile( filename ) : NULL;
+    if( trace )
+    {
+        char name[32];
+        for( int r = 0; r < d->n_proc; r++ )
+        {
+            sprintf( name, "rank %d", r );
+            writeTraceEvents( trace, r, name, all + offsets[r], counts[r] );
+        }
+        closeTraceFile( trace );
+        printf( "trace: %lld phase events of %d ranks written to %s\n", total, d->n_proc, filename );
+    }
+    free( all );
+    free( offsets );
+    free( counts );
+    free( events );
+}
+
+//
+//  checkpoint of a distributed run in the layout of writeCheckpoint: rank
+//  0 writes the header, every rank a copy of its particles at the offset
+//  of its slice; the write goes on in the background until the next
+//  checkpoint or the end of the run, which syncs the file and only then
+//  renames it over the previous checkpoint
+//
+void startDomainCheckpoint( domain_t *d, const char *filename, long long step, int n )
+{
+    if( d->checkpointPending )
+        finishDomainCheckpoint( d );
+    double start = read_timer( );
+
+    reserveParticles( &d->checkpointCopy, max( d->local.count, 1 ) );
+    memcpy( d->checkpointCopy.p, d->local.p, d->local.count * sizeof(particle_t) );
+    d->checkpointCopy.count = d->local.count;
+
+    long long count = d->local.count, first = 0;
+    MPI_Exscan( &count, &first, 1, MPI_LONG_LONG, MPI_SUM, d->comm );
+    if( d->rank == 0 )
+        first = 0;
+
+    if( !d->checkpointName )
+        d->checkpointName = strdup( filename );
+    char *temporary = (char*) malloc( strlen( filename ) + 5 );
+    sprintf( temporary, "%s.tmp", filename );
+    MPI_File_open( d->comm, temporary, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &d->checkpointFile );
+    MPI_File_set_size( d->checkpointFile, 0 );
+    free( temporary );
+
+    if( d->rank == 0 )
+    {
+        checkpoint_header_t header;
+        initCheckpointHeader( &header, n, step );
+        MPI_File_write_at( d->checkpointFile, 0, &header, sizeof(checkpoint_header_t), MPI_BYTE, MPI_STATUS_IGNORE );
+    }
+    MPI_Offset offset = sizeof(checkpoint_header_t) + first * sizeof(particle_t);
+    MPI_File_iwrite_at_all( d->checkpointFile, offset, d->checkpointCopy.p, d->checkpointCopy.count, d->PARTICLE, &d->checkpointRequest );
+    d->checkpointPending = true;
+    d->checkpointTime += read_timer( ) - start;
+}
+
+void finishDomainCheckpoint( domain_t *d )
+{
+    double start = read_timer( );
+    MPI_Wait( &d->checkpointRequest, MPI_STATUS_IGNORE );
+    MPI_File_sync( d->checkpointFile );
+    MPI_File_close( &d->checkpointFile );
+    MPI_Barrier( d->comm );
+    if( d->rank == 0 )
+    {
+        char *temporary = (char*) malloc( strlen( d->checkpointName ) + 5 );
+        sprintf( temporary, "%s.tmp", d->checkpointName );
+        if( rename( temporary, d->checkpointName ) != 0 )
+            fprintf( stderr, "failed to write checkpoint %s\n", d->checkpointName );
+        free( temporary );
+    }
+    d->checkpointPending = false;
+    d->checkpoints++;
+    d->checkpointTime += read_timer( ) - start;
+}
+
+//
+//  every rank reads an equal share of a checkpoint, written by any number
+//  of ranks, and hands the particles to their owners
+//
+void readDomainCheckpoint( domain_t *d, const char *filename, int n )
+{
+    long long first = (long long)n * d->rank / d->n_proc;
+    long long last = (long long)n * ( d->rank + 1 ) / d->n_proc;
+    reserveParticles( &d->local, max( (int)( last - first ), 1 ) );
+    d->local.count = (int)( last - first );
+
+    MPI_File f;
+    MPI_File_open( d->comm, filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &f );
+    MPI_File_read_at_all( f, sizeof(checkpoint_header_t) + first * sizeof(particle_t), d->local.p, d->local.count, d->PARTICLE, MPI_STATUS_IGNORE );
+    MPI_File_close( &f );
+
+    redistributeParticles( d );
+}
+
+//
+//  send every particle to the rank owning its cell, wherever that is
+//
+void redistributeParticles( domain_t *d )
+{
+    int *sendcounts = (int*) calloc( 4 * d->n_proc, sizeof(int) );
+    int *senddispls = sendcounts + d->n_proc;
+    int *recvcounts = sendcounts + 2 * d->n_proc;
+    int *recvdispls = sendcounts + 3 * d->n_proc;
+
+    int *owner = (int*) malloc( max( d->local.count, 1 ) * sizeof(int) );
+    for( int i = 0; i < d->local.count; i++ )
+    {
+        owner[i] = domainOwner( d, getCell( d->local.p[i].x ), getCell( d->local.p[i].y ) );
+        sendcounts[owner[i]]++;
+    }
+    MPI_Alltoall( sendcounts, 1, MPI_INT, recvcounts, 1, MPI_INT, d->comm );
+
+    int total = 0;
+    for( int r = 0; r < d->n_proc; r++ )
+    {
+        senddispls[r] = r == 0 ? 0 : senddispls[r-1] + sendcounts[r-1];
+        recvdispls[r] = total;
+        total += recvcounts[r];
+    }
+
+    particle_t *sorted = (particle_t*) malloc( max( d->local.count, 1 ) * sizeof(particle_t) );
+    int *next = (int*) malloc( d->n_proc * sizeof(int) );
+    memcpy( next, senddispls, d->n_proc * sizeof(int) );
+    for( int i = 0; i < d->local.count; i++ )
+        sorted[next[owner[i]]++] = d->local.p[i];
+
+    particle_buffer_t received = { NULL, 0, 0 };
+    reserveParticles( &received, max( total, 1 ) );
+    received.count = total;
+    MPI_Alltoallv( sorted, sendcounts, senddispls, d->PARTICLE, received.p, recvcounts, recvdispls, d->PARTICLE, d->comm );
+
+    free( d->local.p );
+    d->local = received;
+    free( next );
+    free( sorted );
+    free( owner );
+    free( sendcounts );
+}
+
+//
+//  place parts - 1 cuts along a row of weights so that the parts carry
+//  about equal weight and are at least minWidth cells wide
+//
+static void weightedCuts( const double *weights, int cells, int parts, int minWidth, int *cuts )
+{
+    double total = 0;
+    for( int c = 0; c < cells; c++ )
+        total += weights[c];
+
+    cuts[0] = 0;
+    cuts[parts] = cells;
+    double prefix = 0;
+    int c = 0;
+    for( int i = 1; i < parts; i++ )
+    {
+        double target = total * i / parts;
+        int lo = cuts[i-1] + minWidth;
+        int hi = cells - ( parts - i ) * minWidth;
+        while( c < lo )
+            prefix += weights[c++];
+        while( c < hi && prefix + weights[c] / 2 < target )
+            prefix += weights[c++];
+        cuts[i] = c;
+    }
+}
+
+//
+//  recompute the cuts from the work measured since the last call so that
+//  every process column and row carries an equal share, then hand the
+//  particles to their new owners
+//
+//  the partition stays rectilinear (weighted strips in x and y) so that the
+//  ghost exchange keeps its eight neighbours
+//
+void rebalanceDomain( domain_t *d )
+{
+    double start = MPI_Wtime( );
+    int sizesteps = getSizesteps();
+
+    //
+    //  a particle's weight is this rank's measured force time per particle,
+    //  or just one before anything has been measured
+    //
+    double cost = d->forceParticles > 0 ? d->forceTime / d->forceParticles : 0;
+    double measured;
+    MPI_Allreduce( &cost, &measured, 1, MPI_DOUBLE, MPI_MIN, d->comm );
+    if( measured <= 0 )
+        cost = 1;
+
+    double *weights = (double*) calloc( 2 * sizesteps, sizeof(double) );
+    for( int i = 0; i < d->local.count; i++ )
+    {
+        weights[getCell( d->local.p[i].x )] += cost;
+        weights[sizesteps + getCell( d->local.p[i].y )] += cost;
+    }
+    MPI_Allreduce( MPI_IN_PLACE, weights, 2 * sizesteps, MPI_DOUBLE, MPI_SUM, d->comm );
+
+    int *xcuts = (int*) malloc( (d->dims[0] + 1) * sizeof(int) );
+    int *ycuts = (int*) malloc( (d->dims[1] + 1) * sizeof(int) );
+    weightedCuts( weights, sizesteps, d->dims[0], d->minWidth, xcuts );
+    weightedCuts( weights + sizesteps, sizesteps, d->dims[1], d->minWidth, ycuts );
+    bool changed = memcmp( xcuts, d->xcuts, (d->dims[0] + 1) * sizeof(int) ) != 0
+                || memcmp( ycuts, d->ycuts, (d->dims[1] + 1) * sizeof(int) ) != 0;
+
+    if( changed )
+    {
+        freeWindow( d );
+        free( d->xcuts );
+        free( d->ycuts );
+        d->xcuts = xcuts;
+        d->ycuts = ycuts;
+        setupWindow( d );
+        redistributeParticles( d );
+        d->rebalances++;
+    }else {
+        free( xcuts );
+        free( ycuts );
+    }
+    free( weights );
+
+    d->forceTime = 0;
+    d->forceParticles = 0;
+    d->rebalanceTime += MPI_Wtime( ) - start;
+}
+
+//
+//  widen the ghost layer to the given number of cells; every subdomain
+//  must be at least that wide so ghosts only come from the eight neighbours
+//
+void setHaloDepth( domain_t *d, int depth )
+{
+    int narrowest = getSizesteps();
+    for( int i = 0; i < d->dims[0]; i++ )
+        narrowest = min( narrowest, d->xcuts[i+1] - d->xcuts[i] );
+    for( int i = 0; i < d->dims[1]; i++ )
+        narrowest = min( narrowest, d->ycuts[i+1] - d->ycuts[i] );
+    if( narrowest < depth )
+    {
+        if( d->rank == 0 )
+            fprintf( stderr, "a halo of %d cells is deeper than the narrowest subdomain (%d cells)\n", depth, narrowest );
+        MPI_Abort( d->comm, 1 );
+    }
+
+    freeWindow( d );
+    d->halo = depth;
+    d->minWidth = depth;
+    setupWindow( d );
+}
+
+//
+//  true if the whole neighbourhood of cell (cx, cy) is inside the squares,
+//  so the forces on its particles can be computed
+//
+bool forcesInWindow( domain_t *d, int cx, int cy )
+{
+    int sizesteps = getSizesteps();
+    return ( cx == 0 || cx - 1 >= d->originX ) && ( cx == sizesteps - 1 || cx + 1 < d->originX + d->width )
+        && ( cy == 0 || cy - 1 >= d->originY ) && ( cy == sizesteps - 1 || cy + 1 < d->originY + d->height );
+}
+
+//
+//  drop ghosts that drifted out of the squares and note the cells of the rest
+//
+void trimDeepHalo( domain_t *d )
+{
+    int sizesteps = getSizesteps();
+    d->ghostCells = (int*) realloc( d->ghostCells, max( d->ghosts.capacity, 1 ) * sizeof(int) );
+    int kept = 0;
+    for( int i = 0; i < d->ghosts.count; i++ )
+    {
+        int cx = getCell( d->ghosts.p[i].x );
+        int cy = getCell( d->ghosts.p[i].y );
+        if( cx < d->originX || cx >= d->originX + d->width || cy < d->originY || cy >= d->originY + d->height )
+            continue;
+        d->ghostCells[kept] = cx * sizesteps + cy;
+        d->ghosts.p[kept++] = d->ghosts.p[i];
+    }
+    d->ghosts.count = kept;
+}
+
+//
+//  copy full particles from the halo-deep boundary band to the neighbours,
+//  which advance them redundantly with their own particles until the next
+//  exchange
+//
+void exchangeDeepHalo( domain_t *d )
+{
+    for( int k = 0; k < NEIGHBOURS; k++ )
+        d->send[k].count = 0;
+
+    for( int i = 0; i < d->local.count; i++ )
+    {
+        int cx = getCell( d->local.p[i].x );
+        int cy = getCell( d->local.p[i].y );
+        int xs[3], ys[3];
+        int nx = 0, ny = 0;
+        xs[nx++] = 0;
+        ys[ny++] = 0;
+        if( cx < d->x0 + d->halo ) xs[nx++] = -1;
+        if( cx >= d->x1 - d->halo ) xs[nx++] = 1;
+        if( cy < d->y0 + d->halo ) ys[ny++] = -1;
+        if( cy >= d->y1 - d->halo ) ys[ny++] = 1;
+
+        for( int a = 0; a < nx; a++ )
+            for( int b = 0; b < ny; b++ )
+            {
+                if( xs[a] == 0 && ys[b] == 0 )
+                    continue;
+                int k = directionOf( xs[a], ys[b] );
+                if( d->neighbours[k] != MPI_PROC_NULL )
+                    pushParticle( &d->send[k], d->local.p[i] );
+            }
+    }
+    for( int k = 0; k < NEIGHBOURS; k++ )
+        d->ghostBytes += (long long)d->send[k].count * sizeof(particle_t);
+
+    double start = MPI_Wtime( );
+    d->ghosts.count = 0;
+    exchange( d, &d->ghosts );
+    d->exposedTime += MPI_Wtime( ) - start;
+    trimDeepHalo( d );
+}
@@ -0,0 +1,565 @@
+#include <mpi.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <omp.h>
+#include "common.h"
+#include "domain.h"
+#include "selection.h"
+#include "stream.h"
+#include "phases.h"
+
+//
+//  particles of one kind (owned or ghost) sorted by the cell they are in,
+//  cells are numbered within the squares of the domain
+//
+typedef struct
+{
+    int *cellStart;
+    int *order;
+    int *cellOf;
+    int *histogram;
+    int cells;
+    int capacity;
+} cell_list_t;
+
+static void freeCellList( cell_list_t *bins )
+{
+    free( bins->cellStart );
+    free( bins->order );
+    free( bins->cellOf );
+    free( bins->histogram );
+}
+
+//
+//  counting sort of the particles by cell with one histogram per thread;
+//  both passes over the particles use the same static schedule, so every
+//  cell lists its particles in index order no matter the thread count
+//
+static void binParticles( cell_list_t *bins, domain_t *d, particle_t *p, int count, const int *globalCells )
+{
+    int cells = d->width * d->height;
+    int threads = omp_get_max_threads();
+    if( cells != bins->cells )
+    {
+        bins->cells = cells;
+        bins->cellStart = (int*) realloc( bins->cellStart, (cells + 1) * sizeof(int) );
+        bins->histogram = (int*) realloc( bins->histogram, (size_t)threads * cells * sizeof(int) );
+    }
+    if( count > bins->capacity )
+    {
+        bins->capacity = max( count, 2 * bins->capacity );
+        bins->order = (int*) realloc( bins->order, bins->capacity * sizeof(int) );
+        bins->cellOf = (int*) realloc( bins->cellOf, bins->capacity * sizeof(int) );
+    }
+
+    int sizesteps = getSizesteps();
+#pragma omp parallel
+    {
+        int thread = omp_get_thread_num();
+        startPhase( thread, PHASE_BIN );
+        int *histogram = bins->histogram + (size_t)thread * cells;
+        memset( histogram, 0, cells * sizeof(int) );
+
+#pragma omp for schedule(static)
+        for( int i = 0; i < count; i++ )
+        {
+            int cx, cy;
+            if( globalCells )
+            {
+                cx = globalCells[i] / sizesteps;
+                cy = globalCells[i] % sizesteps;
+            }else {
+                cx = getCell( p[i].x );
+                cy = getCell( p[i].y );
+            }
+            int c = (cx - d->originX) * d->height + (cy - d->originY);
+            bins->cellOf[i] = c;
+            histogram[c]++;
+        }
+
+        //
+        //  turn the histograms into every thread's offset within the cell
+        //
+#pragma omp for schedule(static)
+        for( int c = 0; c < cells; c++ )
+        {
+            int running = 0;
+            for( int t = 0; t < omp_get_num_threads(); t++ )
+            {
+                int *h = bins->histogram + (size_t)t * cells;
+                int tmp = h[c];
+                h[c] = running;
+                running += tmp;
+            }
+            bins->cellStart[c + 1] = running;
+        }
+
+#pragma omp single
+        {
+            bins->cellStart[0] = 0;
+            for( int c = 0; c < cells; c++ )
+                bins->cellStart[c + 1] += bins->cellStart[c];
+        }
+
+#pragma omp for schedule(static) nowait
+        for( int i = 0; i < count; i++ )
+        {
+            int c = bins->cellOf[i];
+            bins->order[bins->cellStart[c] + histogram[c]++] = i;
+        }
+        startPhase( thread, PHASE_BARRIER );
+#pragma omp barrier
+    }
+}
+
+//
+//  density field of the owned particles from their cell lists
+//
+static void collectDensity( domain_t *d, density_t *density, cell_list_t *bins, long long step )
+{
+    for( int c = 0; c < bins->cells; c++ )
+        for( int k = bins->cellStart[c]; k < bins->cellStart[c + 1]; k++ )
+            addToDensity( density, d->originX + c / d->height, d->originY + c % d->height, d->local.p[bins->order[k]] );
+    writeDomainDensity( d, density, step );
+}
+
+//
+//  the owned particles in the window from the cell lists that overlap it
+//  (and their neighbours, as for the shared memory drivers); nothing to
+//  look at on ranks whose cells miss it
+//
+static void selectFromBins( domain_t *d, selection_t *s, cell_list_t *bins )
+{
+    s->count = 0;
+    int cx0 = max( s->cx0, d->originX ), cx1 = min( s->cx1, d->originX + d->width );
+    int cy0 = max( s->cy0, d->originY ), cy1 = min( s->cy1, d->originY + d->height );
+    if( cx0 >= cx1 || cy0 >= cy1 )
+        return;
+    for( int cx = cx0; cx < cx1; cx++ )
+    {
+        //
+        //  the cells (cx, cy0..cy1-1) are consecutive
+        //
+        int first = (cx - d->originX) * d->height + (cy0 - d->originY);
+        int last = first + (cy1 - cy0);
+        for( int k = bins->cellStart[first]; k < bins->cellStart[last]; k++ )
+        {
+            const particle_t &p = d->local.p[bins->order[k]];
+            if( inWindow( s, p ) )
+                s->p[s->count++] = p;
+        }
+    }
+}
+
+//
+//  forces on the owned particles in cell (cx, cy) from the owned and ghost
+//  particles in its neighbourhood
+//
+static void forcesInCell( domain_t *d, cell_list_t *local, cell_list_t *ghosts, int cx, int cy )
+{
+    int sizesteps = getSizesteps();
+    int c = (cx - d->originX) * d->height + (cy - d->originY);
+    int tempX = max( cx - 1, 0 ), maxX = min( cx + 2, sizesteps );
+    int tempY = max( cy - 1, 0 ), maxY = min( cy + 2, sizesteps );
+
+    for( int k = local->cellStart[c]; k < local->cellStart[c + 1]; k++ )
+    {
+        particle_t &particle = d->local.p[local->order[k]];
+        particle.ax = particle.ay = 0;
+        for( int i = tempX; i < maxX; i++ )
+        {
+            //
+            //  the cells (i, tempY..maxY-1) are consecutive
+            //
+            int first = (i - d->originX) * d->height + (tempY - d->originY);
+            int last = first + (maxY - tempY);
+            for( int j = local->cellStart[first]; j < local->cellStart[last]; j++ )
+                apply_force( particle, d->local.p[local->order[j]] );
+            for( int j = ghosts->cellStart[first]; j < ghosts->cellStart[last]; j++ )
+                apply_force( particle, d->ghosts.p[ghosts->order[j]] );
+            COUNT_PAIRS( local->cellStart[last] - local->cellStart[first] + ghosts->cellStart[last] - ghosts->cellStart[first] );
+        }
+    }
+}
+
+//
+//  benchmarking program
+//
+int main( int argc, char **argv )
+{
+    //
+    //  process command line parameters
+    //
+    if( find_option( argc, argv, "-h" ) >= 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-n <int> to set the number of particles\n" );
+        printf( "-o <filename> to specify the output file name\n" );
+        printf( "-seed <int> to set the random seed of the initial configuration\n" );
+        printf( "-checkpoint <filename> to write the full state to that file in the background (the file is only replaced once the next checkpoint starts or the run ends)\n" );
+        printf( "-checkpointfreq <int> to checkpoint every that many steps (default 100)\n" );
+        printf( "-restart <filename> to continue from a checkpoint, written with any number of ranks\n" );
+        printf( "-density <filename> to write the particle count and mean velocity per cell of a coarse grid every SAVEFREQ steps\n" );
+        printf( "-densitycells <int> to set the cells per side of that grid (default 32)\n" );
+        printf( "-window <x0,y0,x1,y1> to save only the particles inside that rectangle (binary trajectories only, not with -mpiio)\n" );
+        printf( "-stream <name> to publish the frames gathered on rank 0 in shared memory for watch and other live readers\n" );
+        printf( "-streamslots <int> to set the number of frames kept for those readers (default 4)\n" );
+        printf( "-text to write the legacy text format instead of a binary trajectory\n" );
+        printf( "-float to store the positions of the binary trajectory in single precision\n" );
+        printf( "-compress <int> to store positions quantized to that many bits and delta encoded\n" );
+        printf( "-async <int> to queue that many frames for the background writer thread, 0 to write synchronously\n" );
+        printf( "-direct <int> to write the trajectory with O_DIRECT through io_uring, that many writes in flight\n" );
+        printf( "-trace <filename> to write a Chrome trace of the phases of every thread of every rank (built with PHASE_TIMERS)\n" );
+        printf( "-tracecapacity <int> to keep only the last that many phase events per thread in the trace (default 65536)\n" );
+        printf( "-counters to count cycles, instructions and cache and branch misses of every phase with perf_event_open (built with PHASE_TIMERS)\n" );
+        printf( "-mpiio to write the trajectory collectively with MPI-IO instead of from rank 0 (not with -compress)\n" );
+        printf( "-blocking to finish the ghost exchange before computing any forces\n" );
+        printf( "-packghosts to send ghost positions as floats relative to their cell\n" );
+        printf( "-balance <int> to rebalance the subdomains every that many steps\n" );
+        printf( "threads per rank are set with OMP_NUM_THREADS, e.g. OMP_NUM_THREADS=4 mpirun -np 2\n" );
+        return 0;
+    }
+
+    printf("HYBRID RUN");
+
+    int n = read_int( argc, argv, "-n", 1000 );
+    char *savename = read_string( argc, argv, "-o", NULL );
+    bool overlap = find_option( argc, argv, "-blocking" ) < 0;
+    bool text = find_option( argc, argv, "-text" ) >= 0;
+    bool mpiio = !text && find_option( argc, argv, "-compress" ) < 0 && find_option( argc, argv, "-mpiio" ) >= 0;
+    int precision = find_option( argc, argv, "-float" ) >= 0 ? sizeof(float) : sizeof(double);
+    int balance = read_int( argc, argv, "-balance", 0 );
+
+    //
+    //  set up MPI, only the master thread of every rank communicates
+    //
+    int n_proc, rank, provided;
+    MPI_Init_thread( &argc, &argv, MPI_THREAD_FUNNELED, &provided );
+    MPI_Comm_size( MPI_COMM_WORLD, &n_proc );
+    MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+    if( provided < MPI_THREAD_FUNNELED )
+    {
+        if( rank == 0 )
+            fprintf( stderr, "the MPI library does not support MPI_THREAD_FUNNELED\n" );
+        MPI_Abort( MPI_COMM_WORLD, 1 );
+    }
+
+    MPI_Datatype PARTICLE;
+    MPI_Type_contiguous( 6, MPI_DOUBLE, &PARTICLE );
+    MPI_Type_commit( &PARTICLE );
+
+    //
+    //  a restart takes the number of particles from the checkpoint
+    //
+    char *restartname = read_string( argc, argv, "-restart", NULL );
+    checkpoint_header_t restart;
+    if( restartname )
+    {
+        int valid = rank == 0 ? readCheckpointHeader( restartname, &restart ) : 0;
+        MPI_Bcast( &valid, 1, MPI_INT, 0, MPI_COMM_WORLD );
+        if( !valid )
+        {
+            MPI_Finalize( );
+            return 1;
+        }
+        MPI_Bcast( &restart, sizeof(checkpoint_header_t), MPI_BYTE, 0, MPI_COMM_WORLD );
+        n = (int)restart.n;
+    }
+    char *checkpointname = read_string( argc, argv, "-checkpoint", NULL );
+    int checkpointfreq = max( read_int( argc, argv, "-checkpointfreq", 100 ), 1 );
+
+    set_size( n );
+    domain_t domain;
+    initDomain( &domain, MPI_COMM_WORLD, PARTICLE );
+    rank = domain.rank;
+    domain.ghostFormat = find_option( argc, argv, "-packghosts" ) >= 0 ? GHOST_FLOAT : GHOST_DOUBLE;
+
+    //
+    //  a window is cut out of every subdomain and gathered on rank 0; the
+    //  ranks do not know the index of their particles, so there is no
+    //  sample
+    //
+    selection_t *selection = readSelection( argc, argv, n );
+    if( selection && selection->every > 1 )
+    {
+        if( rank == 0 )
+            fprintf( stderr, "-sample needs the particle indices, which the MPI drivers do not keep\n" );
+        selection->every = 1;
+        if( !selection->window )
+        {
+            freeSelection( selection );
+            selection = NULL;
+        }
+    }
+    if( selection )
+        mpiio = false;
+
+    //
+    //  allocate generic resources, only rank 0 of the (reordered) process
+    //  grid ever holds all particles, and none does with MPI-IO
+    //
+    FILE *fsave = savename && text && rank == 0 ? fopen( savename, "w" ) : NULL;
+    trajectory_t *trajectory = savename && !text && !mpiio && rank == 0 ? openTrajectory( savename, n, precision, read_int( argc, argv, "-async", 2 ) ) : NULL;
+    if( trajectory && selection )
+        countTrajectory( trajectory );
+    if( trajectory && find_option( argc, argv, "-compress" ) >= 0 )
+        compressTrajectory( trajectory, read_int( argc, argv, "-compress", 20 ) );
+    if( trajectory && find_option( argc, argv, "-direct" ) >= 0 )
+        directTrajectory( trajectory, savename, read_int( argc, argv, "-direct", 8 ) );
+
+    //
+    //  a stream is fed from rank 0 with the gathered particles, with MPI-IO
+    //  too
+    //
+    char *streamname = read_string( argc, argv, "-stream", NULL );
+    stream_t *stream = streamname && rank == 0 ? openStream( streamname, n, read_int( argc, argv, "-streamslots", 4 ) ) : NULL;
+    particle_t *particles = ( ( savename && !mpiio ) || streamname ) && rank == 0 ? (particle_t*) malloc( n * sizeof(particle_t) ) : NULL;
+    if( savename && mpiio )
+        openSnapshots( &domain, savename, n, precision );
+    char *densityname = read_string( argc, argv, "-density", NULL );
+    density_t *density = densityname ? openDensity( rank == 0 ? densityname : NULL, n, read_int( argc, argv, "-densitycells", 32 ) ) : NULL;
+
+    //
+    //  every rank generates the particles that start in its subdomain
+    //
+    int firstStep = 0;
+    if( restartname )
+    {
+        set_seed( restart.seed );
+        readDomainCheckpoint( &domain, restartname, n );
+        firstStep = (int)restart.step;
+    }else {
+        long seed = read_int( argc, argv, "-seed", (int)time( NULL ) );
+        MPI_Bcast( &seed, 1, MPI_LONG, 0, domain.comm );
+        set_seed( seed );
+        initLocalParticles( &domain, n );
+    }
+
+    cell_list_t localBins, ghostBins;
+    memset( &localBins, 0, sizeof(cell_list_t) );
+    memset( &ghostBins, 0, sizeof(cell_list_t) );
+
+    if( rank == 0 )
+        printf( "NUMBER OF RANKS = %d, THREADS PER RANK = %d\n", n_proc, omp_get_max_threads() );
+
+    //
+    //  simulate a number of time steps
+    //
+    double total_force_time = 0;
+    double simulation_time = read_timer( );
+
+    //
+    //  every thread marks its phases inside the parallel regions, which end
+    //  in an explicit barrier; in between the master thread marks the
+    //  communication and saving while the others wait at that barrier
+    //
+    initPhaseTimers( omp_get_max_threads() );
+    char *tracename = read_string( argc, argv, "-trace", NULL );
+    if( tracename )
+    {
+        //
+        //  the trace is written collectively, so by all ranks or none
+        //
+        MPI_Barrier( domain.comm );
+        int started = startTrace( read_int( argc, argv, "-tracecapacity", 65536 ) ), everywhere;
+        MPI_Allreduce( &started, &everywhere, 1, MPI_INT, MPI_MIN, domain.comm );
+        if( !everywhere )
+            tracename = NULL;
+    }
+    if( find_option( argc, argv, "-counters" ) >= 0 )
+        startCounters( );
+    for( int step = firstStep; step < NSTEPS; step++ )
+    {
+        //
+        //  save current step if necessary (slightly different semantics than in other codes)
+        //
+        startPhase( 0, PHASE_SAVE );
+        bool saving = ( savename || streamname ) && (step%SAVEFREQ) == 0;
+        if( saving && !selection )
+        {
+            if( savename && mpiio )
+                writeSnapshot( &domain, step );
+            if( !mpiio || streamname )
+            {
+                gatherParticles( &domain, particles );
+                if( fsave )
+                    save( fsave, n, particles );
+                if( trajectory )
+                    writeFrame( trajectory, step, particles );
+                if( stream )
+                    publishFrame( stream, step, n, particles );
+            }
+        }
+
+        //
+        //  fetch the ghosts while the threads bin the owned particles and
+        //  compute the forces in the interior cells
+        //
+        startPhase( 0, PHASE_COMM );
+        startGhostExchange( &domain );
+        binParticles( &localBins, &domain, domain.local.p, domain.local.count, NULL );
+        binParticles( &ghostBins, &domain, NULL, 0, NULL );
+        startPhase( 0, PHASE_SAVE );
+        if( density && (step%SAVEFREQ) == 0 )
+            collectDensity( &domain, density, &localBins, step );
+        if( saving && selection )
+        {
+            selectFromBins( &domain, selection, &localBins );
+            int count = gatherSelected( &domain, selection->p, selection->count, particles );
+            if( trajectory )
+                writeParticles( trajectory, step, count, particles );
+            if( stream )
+                publishFrame( stream, step, count, particles );
+        }
+        double force_time = read_timer( );
+
+        int ix0, ix1, iy0, iy1;
+        interiorCells( &domain, &ix0, &ix1, &iy0, &iy1 );
+        if( !overlap )
+            ix1 = ix0;
+        int interior = (ix1 - ix0) * (iy1 - iy0);
+#pragma omp parallel
+        {
+            int thread = omp_get_thread_num();
+            int done = 0;
+            startPhase( thread, PHASE_FORCE );
+
+            //
+            //  the master thread moves the exchange on every 32 cells it
+            //  computed itself, whichever chunks it draws
+            //
+#pragma omp for schedule(dynamic, 16) nowait
+            for( int c = 0; c < interior; c++ )
+            {
+                forcesInCell( &domain, &localBins, &ghostBins, ix0 + c / (iy1 - iy0), iy0 + c % (iy1 - iy0) );
+                if( thread == 0 && ++done % 32 == 0 )
+                    testGhostExchange( &domain );
+            }
+            startPhase( thread, PHASE_BARRIER );
+#pragma omp barrier
+        }
+
+        startPhase( 0, PHASE_COMM );
+        finishGhostExchange( &domain );
+        binParticles( &ghostBins, &domain, domain.ghosts.p, domain.ghosts.count, domain.ghostCells );
+
+        //
+        //  then the border cells, or all of them without overlap
+        //
+        int width = domain.x1 - domain.x0, height = domain.y1 - domain.y0;
+#pragma omp parallel
+        {
+            int thread = omp_get_thread_num();
+            startPhase( thread, PHASE_FORCE );
+#pragma omp for schedule(dynamic, 16) nowait
+            for( int c = 0; c < width * height; c++ )
+            {
+                int cx = domain.x0 + c / height, cy = domain.y0 + c % height;
+                if( cx < ix0 || cx >= ix1 || cy < iy0 || cy >= iy1 )
+                    forcesInCell( &domain, &localBins, &ghostBins, cx, cy );
+            }
+            startPhase( thread, PHASE_BARRIER );
+#pragma omp barrier
+        }
+        force_time = read_timer( ) - force_time;
+        domain.forceTime += force_time;
+        domain.forceParticles += domain.local.count;
+        total_force_time += force_time;
+
+        //
+        //  move particles
+        //
+#pragma omp parallel
+        {
+            int thread = omp_get_thread_num();
+            startPhase( thread, PHASE_MOVE );
+#pragma omp for schedule(static) nowait
+            for( int i = 0; i < domain.local.count; i++ )
+                move( domain.local.p[i] );
+            startPhase( thread, PHASE_BARRIER );
+#pragma omp barrier
+        }
+
+        //
+        //  hand particles that crossed into another subdomain to their owner
+        //
+        startPhase( 0, PHASE_COMM );
+        migrateParticles( &domain );
+
+        if( balance > 0 && (step+1)%balance == 0 )
+            rebalanceDomain( &domain );
+
+        //
+        //  checkpoint the state the next step starts from
+        //
+        startPhase( 0, PHASE_SAVE );
+        if( checkpointname && (step+1)%checkpointfreq == 0 )
+            startDomainCheckpoint( &domain, checkpointname, step+1, n );
+    }
+    if( domain.checkpointPending )
+        finishDomainCheckpoint( &domain );
+#pragma omp parallel
+    stopPhase( omp_get_thread_num() );
+    simulation_time = read_timer( ) - simulation_time;
+
+    if( rank == 0 )
+        printf( "n = %d, n_procs = %d, n_threads = %d, simulation time = %g s\n", n, n_proc, omp_get_max_threads(), simulation_time );
+    printDomainPhases( &domain );
+    if( tracename )
+        writeDomainTrace( &domain, tracename );
+
+    double comm[2] = { domain.exposedTime, domain.hiddenTime }, maxcomm[2], sumcomm[2];
+    MPI_Reduce( comm, maxcomm, 2, MPI_DOUBLE, MPI_MAX, 0, domain.comm );
+    MPI_Reduce( comm, sumcomm, 2, MPI_DOUBLE, MPI_SUM, 0, domain.comm );
+    double load[2] = { total_force_time, (double)domain.local.count }, maxload[2], sumload[2];
+    MPI_Reduce( load, maxload, 2, MPI_DOUBLE, MPI_MAX, 0, domain.comm );
+    MPI_Reduce( load, sumload, 2, MPI_DOUBLE, MPI_SUM, 0, domain.comm );
+    if( rank == 0 )
+    {
+        printf( "ghost exchange %s: exposed avg %g s max %g s, hidden avg %g s max %g s\n", overlap ? "overlapped" : "blocking",
+                sumcomm[0] / n_proc, maxcomm[0], sumcomm[1] / n_proc, maxcomm[1] );
+        printf( "force time max/avg %g, particles max/avg %g\n", maxload[0] / ( sumload[0] / n_proc ), maxload[1] / ( sumload[1] / n_proc ) );
+    }
+
+    //
+    //  time the simulation spent on checkpoints
+    //
+    if( checkpointname )
+    {
+        double checkpointTime;
+        MPI_Reduce( &domain.checkpointTime, &checkpointTime, 1, MPI_DOUBLE, MPI_MAX, 0, domain.comm );
+        if( rank == 0 )
+            printf( "checkpoints: %d written to %s, max %g s spent by the simulation\n", domain.checkpoints, checkpointname, checkpointTime );
+    }
+
+    //
+    //  release resources
+    //
+    freeCellList( &localBins );
+    freeCellList( &ghostBins );
+    if( domain.snapshots )
+        closeSnapshots( &domain );
+    if( density )
+        closeDensity( density );
+    if( stream )
+        closeStream( stream );
+    if( selection )
+        freeSelection( selection );
+    freeDomain( &domain );
+    freePhaseTimers( );
+    MPI_Type_free( &PARTICLE );
+    free( particles );
+    if( fsave )
+        fclose( fsave );
+    if( trajectory )
+        closeTrajectory( trajectory );
+
+    MPI_Finalize( );
+
+    return 0;
+}
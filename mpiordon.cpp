@@ -3,29 +3,102 @@
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
 #include "common.h"
+#include "domain.h"
+#include "selection.h"
+#include "stream.h"
+#include "phases.h"
 
-void putInSquare(particle_t* particle, square_t **squares, square_t **previousSquares, double interval, double cutoff, int *squareCounter){
-    int x;
-    int y;
-    x = static_cast<int>(std::floor(particle->x / interval));
-    y = static_cast<int>(std::floor(particle->y / interval));
-
-    particle_node_t * ny;
-    ny = (particle_node_t*) malloc(sizeof(particle_node_t));
-    ny->p = particle;
-
-    if(squares[x][y].particles == nullptr){
-        ny->next = nullptr;
-        squares[x][y].occupied = true;
-        previousSquares[*squareCounter] = &squares[x][y];
-        *squareCounter = *squareCounter + 1;
-    }else {
-        particle_node_t * rest;
-        rest = squares[x][y].particles;
-        ny->next = rest;
+//
+//  one step with a single ghost layer: fetch the boundary cells of the
+//  neighbouring subdomains while computing the forces in the interior
+//  cells, which do not need them; returns the time spent on forces
+//
+double overlappedStep( domain_t *domain, bool overlap )
+{
+    startPhase( 0, PHASE_COMM );
+    startGhostExchange( domain );
+    startPhase( 0, PHASE_BIN );
+    binLocal( domain );
+    startPhase( 0, PHASE_FORCE );
+    double force_time = read_timer( );
+
+    int ix0, ix1, iy0, iy1;
+    interiorCells( domain, &ix0, &ix1, &iy0, &iy1 );
+    if( !overlap )
+        ix1 = ix0;
+    int computed = 0;
+    for( int cx = ix0; cx < ix1; cx++ )
+        for( int cy = iy0; cy < iy1; cy++ )
+        {
+            applyForcesInCell( domain, cx, cy );
+            if( ++computed % 32 == 0 )
+                testGhostExchange( domain );
+        }
+
+    startPhase( 0, PHASE_COMM );
+    finishGhostExchange( domain );
+    startPhase( 0, PHASE_BIN );
+    binGhosts( domain );
+
+    //
+    //  then the border cells, or all of them without overlap
+    //
+    startPhase( 0, PHASE_FORCE );
+    for( int cx = domain->x0; cx < domain->x1; cx++ )
+        for( int cy = domain->y0; cy < domain->y1; cy++ )
+            if( cx < ix0 || cx >= ix1 || cy < iy0 || cy >= iy1 )
+                applyForcesInCell( domain, cx, cy );
+    force_time = read_timer( ) - force_time;
+
+    //
+    //  move particles
+    //
+    startPhase( 0, PHASE_MOVE );
+    for( int i = 0; i < domain->local.count; i++ )
+        move( domain->local.p[i] );
+
+    return force_time;
+}
+
+//
+//  one step with deep halos: ghosts are exchanged every halo steps and
+//  moved along with the owned particles in between; the outermost ghosts
+//  miss some of their neighbours, so the correct region shrinks by a cell
+//  per step (plus the drift of the particles, hence one layer more than
+//  steps)
+//
+double deepHaloStep( domain_t *domain, bool exchange )
+{
+    startPhase( 0, PHASE_COMM );
+    if( exchange )
+        exchangeDeepHalo( domain );
+    startPhase( 0, PHASE_BIN );
+    binDomain( domain );
+
+    startPhase( 0, PHASE_FORCE );
+    double force_time = read_timer( );
+    for( int i = 0; i < domain->local.count; i++ )
+        applyForcesWindow( &domain->local.p[i], domain->squares, domain->originX, domain->originY );
+    for( int i = 0; i < domain->ghosts.count; i++ )
+    {
+        particle_t &p = domain->ghosts.p[i];
+        if( forcesInWindow( domain, getCell( p.x ), getCell( p.y ) ) )
+            applyForcesWindow( &p, domain->squares, domain->originX, domain->originY );
+        else
+            p.ax = p.ay = 0;
     }
-    squares[x][y].particles = ny;
+    force_time = read_timer( ) - force_time;
+
+    startPhase( 0, PHASE_MOVE );
+    for( int i = 0; i < domain->local.count; i++ )
+        move( domain->local.p[i] );
+    for( int i = 0; i < domain->ghosts.count; i++ )
+        move( domain->ghosts.p[i] );
+    trimDeepHalo( domain );
+
+    return force_time;
 }
 
 //
@@ -42,6 +115,30 @@ int main( int argc, char **argv )
         printf( "-h to see this help\n" );
         printf( "-n <int> to set the number of particles\n" );
         printf( "-o <filename> to specify the output file name\n" );
+        printf( "-seed <int> to set the random seed of the initial configuration\n" );
+        printf( "-checkpoint <filename> to write the full state to that file in the background (the file is only replaced once the next checkpoint starts or the run ends)\n" );
+        printf( "-checkpointfreq <int> to checkpoint every that many steps (default 100)\n" );
+        printf( "-restart <filename> to continue from a checkpoint, written with any number of ranks\n" );
+        printf( "-density <filename> to write the particle count and mean velocity per cell of a coarse grid every SAVEFREQ steps\n" );
+        printf( "-densitycells <int> to set the cells per side of that grid (default 32)\n" );
+        printf( "-window <x0,y0,x1,y1> to save only the particles inside that rectangle (binary trajectories only, not with -mpiio)\n" );
+        printf( "-stream <name> to publish the frames gathered on rank 0 in shared memory for watch and other live readers\n" );
+        printf( "-streamslots <int> to set the number of frames kept for those readers (default 4)\n" );
+        printf( "-text to write the legacy text format instead of a binary trajectory\n" );
+        printf( "-float to store the positions of the binary trajectory in single precision\n" );
+        printf( "-compress <int> to store positions quantized to that many bits and delta encoded\n" );
+        printf( "-async <int> to queue that many frames for the background writer thread, 0 to write synchronously\n" );
+        printf( "-direct <int> to write the trajectory with O_DIRECT through io_uring, that many writes in flight\n" );
+        printf( "-trace <filename> to write a Chrome trace of the phases of every rank (built with PHASE_TIMERS)\n" );
+        printf( "-tracecapacity <int> to keep only the last that many phase events per thread in the trace (default 65536)\n" );
+        printf( "-counters to count cycles, instructions and cache and branch misses of every phase with perf_event_open (built with PHASE_TIMERS)\n" );
+        printf( "-mpiio to write the trajectory collectively with MPI-IO instead of from rank 0 (not with -compress)\n" );
+        printf( "-blocking to finish the ghost exchange before computing any forces\n" );
+        printf( "-packghosts to send ghost positions as floats relative to their cell\n" );
+        printf( "-sharedhalos to read the ghosts of neighbours on the same node from shared memory (not with -halo or -neighbourhood)\n" );
+        printf( "-neighbourhood to exchange ghosts with MPI_Ineighbor_alltoallv instead of point to point (not with -halo or -sharedhalos)\n" );
+        printf( "-balance <int> to rebalance the subdomains every that many steps (or halo exchanges)\n" );
+        printf( "-halo <int> to exchange deep halos only every that many steps (not with -neighbourhood or -sharedhalos)\n" );
         return 0;
     }
 
@@ -49,6 +146,12 @@ int main( int argc, char **argv )
 
     int n = read_int( argc, argv, "-n", 1000 );
     char *savename = read_string( argc, argv, "-o", NULL );
+    bool overlap = find_option( argc, argv, "-blocking" ) < 0;
+    bool text = find_option( argc, argv, "-text" ) >= 0;
+    bool mpiio = !text && find_option( argc, argv, "-compress" ) < 0 && find_option( argc, argv, "-mpiio" ) >= 0;
+    int precision = find_option( argc, argv, "-float" ) >= 0 ? sizeof(float) : sizeof(double);
+    int balance = read_int( argc, argv, "-balance", 0 );
+    int halo = max( read_int( argc, argv, "-halo", 1 ), 1 );
 
     //
     //  set up MPI
@@ -58,126 +161,279 @@ int main( int argc, char **argv )
     MPI_Comm_size( MPI_COMM_WORLD, &n_proc );
     MPI_Comm_rank( MPI_COMM_WORLD, &rank );
 
-    //
-    //  allocate generic resources
-    //
-    FILE *fsave = savename && rank == 0 ? fopen( savename, "w" ) : NULL;
-    particle_t *particles = (particle_t*) malloc( n * sizeof(particle_t) );
-
     MPI_Datatype PARTICLE;
     MPI_Type_contiguous( 6, MPI_DOUBLE, &PARTICLE );
     MPI_Type_commit( &PARTICLE );
 
     //
-    //  set up the data partitioning across processors
+    //  a restart takes the number of particles from the checkpoint
     //
-    int particle_per_proc = (n + n_proc - 1) / n_proc;
-    int *partition_offsets = (int*) malloc( (n_proc+1) * sizeof(int) );
-    for( int i = 0; i < n_proc+1; i++ )
-        partition_offsets[i] = min( i * particle_per_proc, n );
+    char *restartname = read_string( argc, argv, "-restart", NULL );
+    checkpoint_header_t restart;
+    if( restartname )
+    {
+        int valid = rank == 0 ? readCheckpointHeader( restartname, &restart ) : 0;
+        MPI_Bcast( &valid, 1, MPI_INT, 0, MPI_COMM_WORLD );
+        if( !valid )
+        {
+            MPI_Finalize( );
+            return 1;
+        }
+        MPI_Bcast( &restart, sizeof(checkpoint_header_t), MPI_BYTE, 0, MPI_COMM_WORLD );
+        n = (int)restart.n;
+    }
+    char *checkpointname = read_string( argc, argv, "-checkpoint", NULL );
+    int checkpointfreq = max( read_int( argc, argv, "-checkpointfreq", 100 ), 1 );
 
-    int *partition_sizes = (int*) malloc( n_proc * sizeof(int) );
-    for( int i = 0; i < n_proc; i++ )
-        partition_sizes[i] = partition_offsets[i+1] - partition_offsets[i];
+    //
+    //  split the cell grid into one block of cells per processor
+    //
+    set_size( n );
+    domain_t domain;
+    initDomain( &domain, MPI_COMM_WORLD, PARTICLE );
+    rank = domain.rank;
+    domain.ghostFormat = find_option( argc, argv, "-packghosts" ) >= 0 ? GHOST_FLOAT : GHOST_DOUBLE;
 
     //
-    //  allocate storage for local partition
+    //  deep halos, the neighbourhood collective and shared halos are
+    //  exclusive ghost exchanges, taken in that order of precedence
     //
-    int nlocal = partition_sizes[rank];
-    particle_t *local = (particle_t*) malloc( nlocal * sizeof(particle_t) );
+    bool neighbourhood = find_option( argc, argv, "-neighbourhood" ) >= 0;
+    bool sharedhalos = find_option( argc, argv, "-sharedhalos" ) >= 0;
+    if( halo > 1 )
+        setHaloDepth( &domain, halo + 1 );
+    else if( neighbourhood )
+        domain.exchangeBackend = EXCHANGE_NEIGHBOURHOOD;
+    else if( sharedhalos )
+        enableSharedHalos( &domain );
+    if( rank == 0 && neighbourhood && halo > 1 )
+        fprintf( stderr, "-neighbourhood is ignored with -halo\n" );
+    if( rank == 0 && sharedhalos && ( halo > 1 || neighbourhood ) )
+        fprintf( stderr, "-sharedhalos is ignored with %s\n", halo > 1 ? "-halo" : "-neighbourhood" );
 
     //
-    //  initialize and distribute the particles (that's fine to leave it unoptimized)
+    //  a window is cut out of every subdomain and gathered on rank 0; the
+    //  ranks do not know the index of their particles, so there is no
+    //  sample
     //
-    set_size( n );
-    if( rank == 0 )
-        init_particles( n, particles );
-
-    MPI_Scatterv( particles, partition_sizes, partition_offsets, PARTICLE, local, nlocal, PARTICLE, 0, MPI_COMM_WORLD );
-
-    square_t **squares;
-    square_t **previousSquares;
-    double interval;
-    double cutoff = 0.01;
-    int squareCounter = 0;
-
-    int sizesteps = getSizesteps();
-    interval = getIntervall();
-    int squaresToClear = 0;
-
-    previousSquares = (square_t**) malloc(n * sizeof(square_t*));
-    squares = (square_t**) malloc(sizesteps * sizeof(square_t*));
-    for(int i = 0; i < sizesteps; i++){
-        squares[i] = (square_t*) malloc(sizesteps * sizeof(square_t));
-        for(int j = 0; j < sizesteps; j++){
-            initSquare(&squares[i][j]);
+    selection_t *selection = readSelection( argc, argv, n );
+    if( selection && selection->every > 1 )
+    {
+        if( rank == 0 )
+            fprintf( stderr, "-sample needs the particle indices, which the MPI drivers do not keep\n" );
+        selection->every = 1;
+        if( !selection->window )
+        {
+            freeSelection( selection );
+            selection = NULL;
         }
     }
+    if( selection )
+        mpiio = false;
+
+    //
+    //  allocate generic resources, only rank 0 of the (reordered) process
+    //  grid ever holds all particles, and none does with MPI-IO
+    //
+    FILE *fsave = savename && text && rank == 0 ? fopen( savename, "w" ) : NULL;
+    trajectory_t *trajectory = savename && !text && !mpiio && rank == 0 ? openTrajectory( savename, n, precision, read_int( argc, argv, "-async", 2 ) ) : NULL;
+    if( trajectory && selection )
+        countTrajectory( trajectory );
+    if( trajectory && find_option( argc, argv, "-compress" ) >= 0 )
+        compressTrajectory( trajectory, read_int( argc, argv, "-compress", 20 ) );
+    if( trajectory && find_option( argc, argv, "-direct" ) >= 0 )
+        directTrajectory( trajectory, savename, read_int( argc, argv, "-direct", 8 ) );
+
+    //
+    //  a stream is fed from rank 0 with the gathered particles, with MPI-IO
+    //  too
+    //
+    char *streamname = read_string( argc, argv, "-stream", NULL );
+    stream_t *stream = streamname && rank == 0 ? openStream( streamname, n, read_int( argc, argv, "-streamslots", 4 ) ) : NULL;
+    particle_t *particles = ( ( savename && !mpiio ) || streamname ) && rank == 0 ? (particle_t*) malloc( n * sizeof(particle_t) ) : NULL;
+    if( savename && mpiio )
+        openSnapshots( &domain, savename, n, precision );
+    char *densityname = read_string( argc, argv, "-density", NULL );
+    density_t *density = densityname ? openDensity( rank == 0 ? densityname : NULL, n, read_int( argc, argv, "-densitycells", 32 ) ) : NULL;
+
+    //
+    //  every rank generates the particles that start in its subdomain, the
+    //  same configuration init_particles produces for the seed
+    //
+    int firstStep = 0;
+    if( restartname )
+    {
+        set_seed( restart.seed );
+        readDomainCheckpoint( &domain, restartname, n );
+        firstStep = (int)restart.step;
+    }else {
+        long seed = read_int( argc, argv, "-seed", (int)time( NULL ) );
+        MPI_Bcast( &seed, 1, MPI_LONG, 0, domain.comm );
+        set_seed( seed );
+        initLocalParticles( &domain, n );
+    }
 
     //
     //  simulate a number of time steps
     //
+    double total_force_time = 0;
     double simulation_time = read_timer( );
-    for( int step = 0; step < NSTEPS; step++ )
+    initPhaseTimers( 1 );
+    char *tracename = read_string( argc, argv, "-trace", NULL );
+    if( tracename )
     {
         //
-        //  collect all global data locally (not good idea to do)
+        //  the trace is written collectively, so by all ranks or none
         //
-        MPI_Allgatherv( local, nlocal, PARTICLE, particles, partition_sizes, partition_offsets, PARTICLE, MPI_COMM_WORLD );
-
+        MPI_Barrier( domain.comm );
+        int started = startTrace( read_int( argc, argv, "-tracecapacity", 65536 ) ), everywhere;
+        MPI_Allreduce( &started, &everywhere, 1, MPI_INT, MPI_MIN, domain.comm );
+        if( !everywhere )
+            tracename = NULL;
+    }
+    if( find_option( argc, argv, "-counters" ) >= 0 )
+        startCounters( );
+    for( int step = firstStep; step < NSTEPS; step++ )
+    {
         //
         //  save current step if necessary (slightly different semantics than in other codes)
         //
-        if( fsave && (step%SAVEFREQ) == 0 )
-            save( fsave, n, particles );
-
-        for(int i = 0; i < squaresToClear; i++) {
-            clearSquare(previousSquares[i]);
+        startPhase( 0, PHASE_SAVE );
+        bool saving = ( savename || streamname ) && (step%SAVEFREQ) == 0;
+        if( saving && !selection )
+        {
+            if( savename && mpiio )
+                writeSnapshot( &domain, step );
+            if( !mpiio || streamname )
+            {
+                gatherParticles( &domain, particles );
+                if( fsave )
+                    save( fsave, n, particles );
+                if( trajectory )
+                    writeFrame( trajectory, step, particles );
+                if( stream )
+                    publishFrame( stream, step, n, particles );
+            }
         }
 
-        for(int i = 0; i < n; i++ ){
-            putInSquare(&particles[i], squares, previousSquares, interval, cutoff, &squareCounter);
+        //
+        //  the density and the window are taken while binning, before the
+        //  particles move
+        //
+        domain.density = density && (step%SAVEFREQ) == 0 ? density : NULL;
+        domain.selection = saving ? selection : NULL;
+        double force_time = halo > 1 ? deepHaloStep( &domain, step%halo == 0 || step == firstStep ) : overlappedStep( &domain, overlap );
+        startPhase( 0, PHASE_SAVE );
+        if( domain.density )
+            writeDomainDensity( &domain, domain.density, step );
+        if( domain.selection )
+        {
+            int count = gatherSelected( &domain, selection->p, selection->count, particles );
+            if( trajectory )
+                writeParticles( trajectory, step, count, particles );
+            if( stream )
+                publishFrame( stream, step, count, particles );
         }
-
-        squaresToClear = squareCounter;
-        squareCounter = 0;
+        domain.forceTime += force_time;
+        domain.forceParticles += domain.local.count;
+        total_force_time += force_time;
 
         //
-        //  compute all forces
+        //  hand particles that crossed into another subdomain to their owner,
+        //  with deep halos only once the ghosts are used up
         //
-        for( int i = 0; i < nlocal; i++ )
+        startPhase( 0, PHASE_COMM );
+        if( (step+1)%halo == 0 || step+1 == NSTEPS )
         {
-            applyForces(&local[i], squares);
+            migrateParticles( &domain );
+
+            //
+            //  shift the subdomain boundaries towards the measured work
+            //
+            if( balance > 0 && (step+1)%(balance*halo) == 0 )
+                rebalanceDomain( &domain );
         }
 
         //
-        //  move particles
+        //  checkpoint the state the next step starts from
         //
-        for( int i = 0; i < nlocal; i++ )
-            move( local[i] );
+        startPhase( 0, PHASE_SAVE );
+        if( checkpointname && (step+1)%checkpointfreq == 0 )
+            startDomainCheckpoint( &domain, checkpointname, step+1, n );
     }
+    if( domain.checkpointPending )
+        finishDomainCheckpoint( &domain );
+    stopPhase( 0 );
     simulation_time = read_timer( ) - simulation_time;
 
     if( rank == 0 )
         printf( "n = %d, n_procs = %d, simulation time = %g s\n", n, n_proc, simulation_time );
+    printDomainPhases( &domain );
+    if( tracename )
+        writeDomainTrace( &domain, tracename );
 
     //
-    //  release resources
+    //  ghost exchange time that was waited for vs. overlapped with the interior
     //
-    for(int i = 0; i < squaresToClear; i++) {
-        clearSquare(previousSquares[i]);
+    double comm[4] = { domain.exposedTime, domain.hiddenTime, (double)domain.ghostBytes, (double)domain.sharedBytes }, maxcomm[4], sumcomm[4];
+    MPI_Reduce( comm, maxcomm, 4, MPI_DOUBLE, MPI_MAX, 0, domain.comm );
+    MPI_Reduce( comm, sumcomm, 4, MPI_DOUBLE, MPI_SUM, 0, domain.comm );
+    if( rank == 0 )
+    {
+        if( halo > 1 )
+            printf( "deep halo of %d cells exchanged every %d steps: exposed avg %g s max %g s\n", domain.halo, halo, sumcomm[0] / n_proc, maxcomm[0] );
+        else
+            printf( "ghost exchange %s %s: exposed avg %g s max %g s, hidden avg %g s max %g s\n",
+                    domain.exchangeBackend == EXCHANGE_NEIGHBOURHOOD ? "neighbourhood collective" : "point to point", overlap ? "overlapped" : "blocking",
+                    sumcomm[0] / n_proc, maxcomm[0], sumcomm[1] / n_proc, maxcomm[1] );
+        printf( "ghost payload %s: %g MB sent in total\n", halo > 1 ? "full particles" : domain.ghostFormat == GHOST_FLOAT ? "packed float" : "double", sumcomm[2] / 1e6 );
+        if( domain.sharedHalos )
+            printf( "ghosts read from shared memory: %g MB in total\n", sumcomm[3] / 1e6 );
     }
-    free(previousSquares);
-    for(int i = 0; i < sizesteps; i++){
-        free(squares[i]);
+
+    //
+    //  load balance at the end of the run and what rebalancing cost
+    //
+    double load[3] = { total_force_time, (double)domain.local.count, domain.rebalanceTime }, maxload[3], sumload[3];
+    MPI_Reduce( load, maxload, 3, MPI_DOUBLE, MPI_MAX, 0, domain.comm );
+    MPI_Reduce( load, sumload, 3, MPI_DOUBLE, MPI_SUM, 0, domain.comm );
+    if( rank == 0 )
+    {
+        printf( "force time max/avg %g, particles max/avg %g\n", maxload[0] / ( sumload[0] / n_proc ), maxload[1] / ( sumload[1] / n_proc ) );
+        if( balance > 0 )
+            printf( "rebalanced every %d steps: %d partition changes, max %g s spent rebalancing\n", balance, domain.rebalances, maxload[2] );
     }
-    free(squares);
-    free( partition_offsets );
-    free( partition_sizes );
-    free( local );
+
+    //
+    //  time the simulation spent on checkpoints
+    //
+    if( checkpointname )
+    {
+        double checkpointTime;
+        MPI_Reduce( &domain.checkpointTime, &checkpointTime, 1, MPI_DOUBLE, MPI_MAX, 0, domain.comm );
+        if( rank == 0 )
+            printf( "checkpoints: %d written to %s, max %g s spent by the simulation\n", domain.checkpoints, checkpointname, checkpointTime );
+    }
+
+    //
+    //  release resources
+    //
+    if( domain.snapshots )
+        closeSnapshots( &domain );
+    if( density )
+        closeDensity( density );
+    if( stream )
+        closeStream( stream );
+    if( selection )
+        freeSelection( selection );
+    freeDomain( &domain );
+    freePhaseTimers( );
+    MPI_Type_free( &PARTICLE );
     free( particles );
     if( fsave )
         fclose( fsave );
+    if( trajectory )
+        closeTrajectory( trajectory );
 
     MPI_Finalize( );
 
@@ -3,6 +3,12 @@
 #include <assert.h>
 #include <math.h>
 #include "common.h"
+#include "trajectory.h"
+#include "checkpoint.h"
+#include "density.h"
+#include "stream.h"
+#include "selection.h"
+#include "phases.h"
 #include <omp.h>
 
 square_t **squares;
@@ -10,6 +16,7 @@ square_t **previousSquares;
 double interval;
 double cutoff = 0.01;
 int squareCounter = 0;
+density_t *densityFrame = NULL;
 int n_threads;
 
 void putInSquare(particle_t* particle){
@@ -32,6 +39,9 @@ void putInSquare(particle_t* particle){
         ny->next = rest;
     }
     squares[x][y].particles = ny;
+
+    if( densityFrame )
+        addToDensity( densityFrame, x, y, *particle );
 }
 
 //
@@ -46,21 +56,81 @@ int main( int argc, char **argv )
         printf( "-n <int> to set the number of particles\n" );
         printf( "-p <int> to set the number of threads\n" );
         printf( "-o <filename> to specify the output file name\n" );
+        printf( "-text to write the legacy text format instead of a binary trajectory\n" );
+        printf( "-float to store the positions of the binary trajectory in single precision\n" );
+        printf( "-compress <int> to store positions quantized to that many bits and delta encoded\n" );
+        printf( "-async <int> to queue that many frames for the background writer thread, 0 to write synchronously\n" );
+        printf( "-direct <int> to write the trajectory and checkpoints with O_DIRECT through io_uring, that many writes in flight\n" );
+        printf( "-trace <filename> to write a Chrome trace of the phases of every thread (built with PHASE_TIMERS)\n" );
+        printf( "-tracecapacity <int> to keep only the last that many phase events per thread in the trace (default 65536)\n" );
+        printf( "-counters to count cycles, instructions and cache and branch misses of every phase with perf_event_open (built with PHASE_TIMERS)\n" );
+        printf( "-seed <int> to set the random seed of the initial configuration\n" );
+        printf( "-checkpoint <filename> to write the full state to that file in the background\n" );
+        printf( "-checkpointfreq <int> to checkpoint every that many steps (default 100)\n" );
+        printf( "-restart <filename> to continue from a checkpoint instead of a new configuration\n" );
+        printf( "-density <filename> to write the particle count and mean velocity per cell of a coarse grid every SAVEFREQ steps\n" );
+        printf( "-densitycells <int> to set the cells per side of that grid (default 32)\n" );
+        printf( "-sample <int> to save only every k-th particle\n" );
+        printf( "-window <x0,y0,x1,y1> to save only the particles inside that rectangle (binary trajectories only)\n" );
+        printf( "-stream <name> to publish the saved frames in shared memory for watch and other live readers\n" );
+        printf( "-streamslots <int> to set the number of frames kept for those readers (default 4)\n" );
         return 0;
     }
 
     printf("OPENMP RUN");
 
     int n = read_int( argc, argv, "-n", 1000 );
+
+    //
+    //  a restart takes the number of particles from the checkpoint
+    //
+    char *restartname = read_string( argc, argv, "-restart", NULL );
+    checkpoint_header_t restart;
+    if( restartname )
+    {
+        if( !readCheckpointHeader( restartname, &restart ) )
+            return 1;
+        n = (int)restart.n;
+    }
     n_threads = read_int(argc, argv, "-p", 2 );
     omp_set_num_threads(n_threads);
 
-    char *savename = read_string(argc, argv, "-o", const_cast<char *>("data"));
+    char *densityname = read_string( argc, argv, "-density", NULL );
+    char *streamname = read_string( argc, argv, "-stream", NULL );
+    char *savename = read_string(argc, argv, "-o", densityname || streamname ? NULL : const_cast<char *>("data"));
 
-    FILE *fsave = savename ? fopen( savename, "w" ) : NULL;
+    bool text = find_option( argc, argv, "-text" ) >= 0;
+    FILE *fsave = savename && text ? fopen( savename, "w" ) : NULL;
     particle_t *particles = (particle_t*) malloc( n * sizeof(particle_t) );
     set_size( n );
-    init_particles( n, particles );
+    int firstStep = 0;
+    if( restartname )
+    {
+        set_seed( restart.seed );
+        if( !readCheckpoint( restartname, 0, n, particles ) )
+            return 1;
+        firstStep = (int)restart.step;
+    }else {
+        if( find_option( argc, argv, "-seed" ) >= 0 )
+            set_seed( read_int( argc, argv, "-seed", 0 ) );
+        init_particles( n, particles );
+    }
+    char *checkpointname = read_string( argc, argv, "-checkpoint", NULL );
+    int checkpointfreq = max( read_int( argc, argv, "-checkpointfreq", 100 ), 1 );
+    checkpoint_t *checkpoint = checkpointname ? startCheckpoints( checkpointname, n ) : NULL;
+    selection_t *selection = readSelection( argc, argv, n );
+    trajectory_t *trajectory = savename && !text ? openTrajectory( savename, selection ? selection->capacity : n, find_option( argc, argv, "-float" ) >= 0 ? sizeof(float) : sizeof(double), read_int( argc, argv, "-async", 2 ) ) : NULL;
+    if( trajectory && selection && selection->window )
+        countTrajectory( trajectory );
+    if( trajectory && find_option( argc, argv, "-compress" ) >= 0 )
+        compressTrajectory( trajectory, read_int( argc, argv, "-compress", 20 ) );
+    if( trajectory && find_option( argc, argv, "-direct" ) >= 0 )
+        directTrajectory( trajectory, savename, read_int( argc, argv, "-direct", 8 ) );
+    if( checkpoint && find_option( argc, argv, "-direct" ) >= 0 )
+        directCheckpoints( checkpoint, read_int( argc, argv, "-direct", 8 ) );
+
+    density_t *density = densityname ? openDensity( densityname, n, read_int( argc, argv, "-densitycells", 32 ) ) : NULL;
+    stream_t *stream = streamname ? openStream( streamname, selection ? selection->capacity : n, read_int( argc, argv, "-streamslots", 4 ) ) : NULL;
 
     int sizesteps = getSizesteps();
     interval = getIntervall();
@@ -79,26 +149,45 @@ int main( int argc, char **argv )
     //
     double simulation_time = read_timer( );
 
+    //
+    //  the implicit barriers are explicit, so the timers see the waits
+    //
+    initPhaseTimers( omp_get_max_threads() );
+    char *tracename = read_string( argc, argv, "-trace", NULL );
+    if( tracename && !startTrace( read_int( argc, argv, "-tracecapacity", 65536 ) ) )
+        tracename = NULL;
+    if( find_option( argc, argv, "-counters" ) >= 0 )
+        startCounters( );
 #pragma omp parallel
 {
 #pragma omp master
     printf("NUMBER OF THREADS = %d\n", omp_get_num_threads());
+    int thread = omp_get_thread_num();
 
-    for (int step = 0; step < NSTEPS; step++) {
-#pragma omp single
+    for (int step = firstStep; step < NSTEPS; step++) {
+        startPhase(thread, PHASE_BIN);
+#pragma omp single nowait
         {
             for (int i = 0; i < usedSquares; i++) {
                 clearSquare(previousSquares[i]);
             }
+            densityFrame = density && (step % SAVEFREQ) == 0 ? density : NULL;
             for (int i = 0; i < n; i++) {
                 putInSquare(&particles[i]);
             }
+            if (densityFrame)
+                writeDensity(densityFrame, step);
         }
+        startPhase(thread, PHASE_BARRIER);
+#pragma omp barrier
 
-#pragma omp for schedule(dynamic, 200)
+        startPhase(thread, PHASE_FORCE);
+#pragma omp for schedule(dynamic, 200) nowait
         for (int i = 0; i < n; i++) {
             applyForces(&particles[i], squares);
         }
+        startPhase(thread, PHASE_BARRIER);
+#pragma omp barrier
 
 #pragma omp master
         {
@@ -108,23 +197,47 @@ int main( int argc, char **argv )
         //
         //  move particles
         //
-#pragma omp for schedule(dynamic, 200)
+        startPhase(thread, PHASE_MOVE);
+#pragma omp for schedule(dynamic, 200) nowait
         for (int i = 0; i < n; i++)
             move(particles[i]);
+        startPhase(thread, PHASE_BARRIER);
+#pragma omp barrier
 
         //
         //  save if necessary
         //
+        startPhase(thread, PHASE_SAVE);
 #pragma omp master
         {
+            if (selection && (step % SAVEFREQ) == 0)
+                selectFromSquares(selection, squares, particles, n);
             if (fsave && (step % SAVEFREQ) == 0)
-                save(fsave, n, particles);
+                save(fsave, selection ? selection->count : n, selection ? selection->p : particles);
+            if (trajectory && (step % SAVEFREQ) == 0)
+                writeParticles(trajectory, step, selection ? selection->count : n, selection ? selection->p : particles);
+            if (stream && (step % SAVEFREQ) == 0)
+                publishFrame(stream, step, selection ? selection->count : n, selection ? selection->p : particles);
+            if (checkpoint && (step + 1) % checkpointfreq == 0)
+                saveCheckpoint(checkpoint, step + 1, particles);
+        }
+
+        //
+        //  the selection walks the squares, which the next step clears
+        //
+        if (selection && (step % SAVEFREQ) == 0) {
+            startPhase(thread, PHASE_BARRIER);
+#pragma omp barrier
         }
     }
+    stopPhase(thread);
 }
     simulation_time = read_timer( ) - simulation_time;
 
     printf( "\nn = %d, simulation time = %g seconds\n", n, simulation_time );
+    printPhaseTimers( );
+    if( tracename )
+        writeTrace( tracename );
 
     for(int i = 0; i < sizesteps; i++){
         free(squares[i]);
@@ -134,6 +247,17 @@ int main( int argc, char **argv )
     free( particles );
     if( fsave )
         fclose( fsave );
+    if( trajectory )
+        closeTrajectory( trajectory );
+    if( checkpoint )
+        stopCheckpoints( checkpoint );
+    if( density )
+        closeDensity( density );
+    if( stream )
+        closeStream( stream );
+    if( selection )
+        freeSelection( selection );
+    freePhaseTimers( );
 
     return 0;
 }
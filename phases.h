@@ -0,0 +1,146 @@
+#ifndef __CS267_PHASES_H__
+#define __CS267_PHASES_H__
+
+#include <stdio.h>
+#include <time.h>
+
+//
+//  time every thread spends in the phases of a step, compiled in with
+//  -DPHASE_TIMERS (cmake -DPHASE_TIMERS=ON) and free otherwise: a thread
+//  marks the start of each phase and the time since its previous mark is
+//  added to the phase it was in, one clock read per phase and step
+//
+enum { PHASE_BIN, PHASE_FORCE, PHASE_MOVE, PHASE_SAVE, PHASE_COMM, PHASE_BARRIER, PHASES };
+
+extern const char *phaseNames[PHASES];
+
+//
+//  with a trace, every phase a thread finishes is also kept as an event in
+//  a preallocated ring of the thread's last events (seconds since the
+//  trace started), and written as a Chrome trace (chrome://tracing,
+//  Perfetto) at the end of the run
+//
+typedef struct
+{
+    double start;
+    float duration;
+    short phase;
+    short thread;
+} phase_event_t;
+
+//
+//  one per thread, padded to its own cache lines
+//
+typedef struct
+{
+    double time[PHASES];
+    long long count[PHASES];
+    double mark;
+    phase_event_t *events;
+    long long recorded;
+    int phase;
+    char padding[128 - PHASES * 16 - 28];
+} phase_timer_t;
+
+extern phase_timer_t *phaseTimers;
+extern int phaseThreads;
+extern long long traceMask;
+extern double traceOrigin;
+
+void initPhaseTimers( int threads );
+void phaseStatistics( double *minimum, double *sum, double *maximum );
+void printPhaseStatistics( const double *minimum, const double *sum, const double *maximum, int timers, const char *unit );
+void printPhaseTimers( );
+void freePhaseTimers( );
+
+typedef struct
+{
+    FILE *f;
+    long long events;
+} trace_file_t;
+
+//
+//  hardware counters of every thread per phase, read with perf_event_open
+//  at the phase marks; they only count the thread that opened them, so a
+//  thread opens its group at its first mark; forcePairs counts the particle
+//  pairs the force loops of the thread looked at
+//
+enum { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_L1D_MISSES, COUNTER_LLC_MISSES, COUNTER_BRANCH_MISSES, COUNTERS };
+
+extern const char *counterNames[COUNTERS];
+
+typedef struct alignas(64)
+{
+    int state;
+    int members;
+    int fd[COUNTERS];
+    int slot[COUNTERS];
+    unsigned long long last[COUNTERS];
+    unsigned long long lastEnabled, lastRunning;
+    long long lastPairs;
+    double counts[PHASES][COUNTERS];
+    long long pairs[PHASES];
+} phase_counters_t;
+
+extern phase_counters_t *phaseCounters;
+extern thread_local long long forcePairs;
+
+#ifdef PHASE_TIMERS
+#define COUNT_PAIRS( pairs ) ( forcePairs += (pairs) )
+#else
+#define COUNT_PAIRS( pairs ) ( (void) 0 )
+#endif
+
+bool startCounters( );
+void countPhase( int thread, int phase );
+void counterTotals( double *totals );
+void printCounterTotals( const double *totals, int timers, const char *unit );
+
+bool startTrace( int capacity );
+int collectTraceEvents( phase_event_t **events );
+trace_file_t *openTraceFile( const char *filename );
+void writeTraceEvents( trace_file_t *trace, int process, const char *name, const phase_event_t *events, int count );
+bool closeTraceFile( trace_file_t *trace );
+bool writeTrace( const char *filename );
+
+inline double phaseClock( )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+inline void startPhase( int thread, int phase )
+{
+#ifdef PHASE_TIMERS
+    phase_timer_t *t = &phaseTimers[thread];
+    double now = phaseClock( );
+    if( t->phase >= 0 )
+    {
+        t->time[t->phase] += now - t->mark;
+        t->count[t->phase]++;
+        if( t->events )
+        {
+            phase_event_t *e = &t->events[t->recorded++ & traceMask];
+            e->start = t->mark - traceOrigin;
+            e->duration = (float)( now - t->mark );
+            e->phase = (short)t->phase;
+            e->thread = (short)thread;
+        }
+    }
+    if( phaseCounters )
+        countPhase( thread, t->phase );
+    t->phase = phase;
+    t->mark = now;
+#else
+    (void)thread;
+    (void)phase;
+#endif
+}
+
+inline void stopPhase( int thread )
+{
+    startPhase( thread, -1 );
+}
+
+#endif
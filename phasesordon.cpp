@@ -0,0 +1,424 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "phases.h"
+
+const char *phaseNames[PHASES] = { "binning", "forces", "move", "save", "comm", "barrier" };
+
+const char *counterNames[COUNTERS] = { "cycles", "instructions", "L1D misses", "LLC misses", "branch misses" };
+
+phase_timer_t *phaseTimers = NULL;
+int phaseThreads = 0;
+long long traceMask = 0;
+double traceOrigin = 0;
+phase_counters_t *phaseCounters = NULL;
+thread_local long long forcePairs = 0;
+
+void initPhaseTimers( int threads )
+{
+#ifdef PHASE_TIMERS
+    phaseThreads = threads > 0 ? threads : 1;
+    void *timers = NULL;
+    if( posix_memalign( &timers, 64, phaseThreads * sizeof(phase_timer_t) ) != 0 )
+    {
+        fprintf( stderr, "cannot allocate %d phase timers\n", phaseThreads );
+        exit( 1 );
+    }
+    phaseTimers = (phase_timer_t*) timers;
+    memset( phaseTimers, 0, phaseThreads * sizeof(phase_timer_t) );
+    for( int t = 0; t < phaseThreads; t++ )
+        phaseTimers[t].phase = -1;
+#else
+    (void)threads;
+#endif
+}
+
+//
+//  smallest, summed and largest time of every phase over the threads
+//
+void phaseStatistics( double *minimum, double *sum, double *maximum )
+{
+    for( int p = 0; p < PHASES; p++ )
+    {
+        minimum[p] = phaseThreads > 0 ? phaseTimers[0].time[p] : 0;
+        sum[p] = maximum[p] = 0;
+        for( int t = 0; t < phaseThreads; t++ )
+        {
+            double time = phaseTimers[t].time[p];
+            minimum[p] = time < minimum[p] ? time : minimum[p];
+            maximum[p] = time > maximum[p] ? time : maximum[p];
+            sum[p] += time;
+        }
+    }
+}
+
+void printPhaseStatistics( const double *minimum, const double *sum, const double *maximum, int timers, const char *unit )
+{
+    double total = 0;
+    for( int p = 0; p < PHASES; p++ )
+        total += sum[p];
+    printf( "phase breakdown over %d %s (min, avg, max, share):\n", timers, unit );
+    for( int p = 0; p < PHASES; p++ )
+        if( maximum[p] > 0 )
+            printf( "  %-8s %9.4f s %9.4f s %9.4f s %6.1f%%\n", phaseNames[p],
+                    minimum[p], sum[p] / timers, maximum[p], total > 0 ? 100 * sum[p] / total : 0.0 );
+}
+
+//
+//  breakdown of a run, nothing unless the timers are compiled in
+//
+void printPhaseTimers( )
+{
+#ifdef PHASE_TIMERS
+    double minimum[PHASES], sum[PHASES], maximum[PHASES];
+    phaseStatistics( minimum, sum, maximum );
+    printPhaseStatistics( minimum, sum, maximum, phaseThreads, "threads" );
+    if( phaseCounters )
+    {
+        double totals[PHASES * ( COUNTERS + 1 )];
+        counterTotals( totals );
+        printCounterTotals( totals, phaseThreads, "threads" );
+    }
+#endif
+}
+
+void freePhaseTimers( )
+{
+    for( int t = 0; phaseCounters && t < phaseThreads; t++ )
+        for( int k = 0; k < COUNTERS; k++ )
+            if( phaseCounters[t].fd[k] >= 0 )
+                close( phaseCounters[t].fd[k] );
+    free( phaseCounters );
+    phaseCounters = NULL;
+    for( int t = 0; t < phaseThreads; t++ )
+        free( phaseTimers[t].events );
+    free( phaseTimers );
+    phaseTimers = NULL;
+    phaseThreads = 0;
+}
+
+//
+//  counters for the threads of initPhaseTimers; each thread opens its own
+//  at its next mark
+//
+bool startCounters( )
+{
+#ifdef PHASE_TIMERS
+    void *counters = NULL;
+    if( posix_memalign( &counters, 64, phaseThreads * sizeof(phase_counters_t) ) != 0 )
+    {
+        fprintf( stderr, "cannot allocate %d phase counters\n", phaseThreads );
+        exit( 1 );
+    }
+    memset( counters, 0, phaseThreads * sizeof(phase_counters_t) );
+    phaseCounters = (phase_counters_t*) counters;
+    for( int t = 0; t < phaseThreads; t++ )
+        for( int k = 0; k < COUNTERS; k++ )
+            phaseCounters[t].fd[k] = phaseCounters[t].slot[k] = -1;
+    return true;
+#else
+    fprintf( stderr, "counters need the phase timers, build with -DPHASE_TIMERS\n" );
+    return false;
+#endif
+}
+
+//
+//  user space events of the calling thread on any cpu, cycles leading the
+//  group so that all of them are scheduled (and multiplexed) together
+//
+static const unsigned long long counterEvents[COUNTERS][2] =
+{
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | ( PERF_COUNT_HW_CACHE_OP_READ << 8 ) | ( PERF_COUNT_HW_CACHE_RESULT_MISS << 16 ) },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int openCounter( int counter, int leader )
+{
+    struct perf_event_attr attr;
+    memset( &attr, 0, sizeof(attr) );
+    attr.size = sizeof(attr);
+    attr.type = (unsigned)counterEvents[counter][0];
+    attr.config = counterEvents[counter][1];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+#ifdef __NR_perf_event_open
+    return (int) syscall( __NR_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC );
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+//
+//  the whole group in one read: the number of events, the times the group
+//  was enabled and running, then the counts in the order of opening
+//
+static bool readCounters( const phase_counters_t *c, unsigned long long *values, unsigned long long *enabled, unsigned long long *running )
+{
+    unsigned long long buffer[3 + COUNTERS];
+    ssize_t expected = ( 3 + c->members ) * sizeof(unsigned long long);
+    if( read( c->fd[COUNTER_CYCLES], buffer, sizeof(buffer) ) < expected )
+        return false;
+    *enabled = buffer[1];
+    *running = buffer[2];
+    for( int k = 0; k < COUNTERS; k++ )
+        values[k] = c->slot[k] >= 0 ? buffer[3 + c->slot[k]] : 0;
+    return true;
+}
+
+static int counterWarning = 0;
+
+//
+//  without cycles nothing is counted on the thread; the events the cpu
+//  lacks besides cycles are left out of the group and stay zero
+//
+static void openCounters( phase_counters_t *c )
+{
+    c->fd[COUNTER_CYCLES] = openCounter( COUNTER_CYCLES, -1 );
+    if( c->fd[COUNTER_CYCLES] < 0 )
+    {
+        c->state = -1;
+        int error = errno;
+        if( !__atomic_exchange_n( &counterWarning, 1, __ATOMIC_RELAXED ) )
+            fprintf( stderr, "no hardware counters: %s%s\n", strerror( error ),
+                     error == EACCES || error == EPERM ? " (see /proc/sys/kernel/perf_event_paranoid)" :
+                     error == ENOENT || error == EOPNOTSUPP ? " (no PMU, as in many virtual machines)" : "" );
+        return;
+    }
+    c->slot[COUNTER_CYCLES] = 0;
+    c->members = 1;
+    for( int k = 0; k < COUNTERS; k++ )
+    {
+        if( k == COUNTER_CYCLES )
+            continue;
+        c->fd[k] = openCounter( k, c->fd[COUNTER_CYCLES] );
+        if( c->fd[k] >= 0 )
+            c->slot[k] = c->members++;
+    }
+    c->state = readCounters( c, c->last, &c->lastEnabled, &c->lastRunning ) ? 1 : -1;
+    c->lastPairs = forcePairs;
+}
+
+//
+//  called by startPhase on every mark of a thread with the phase it leaves
+//  (-1 if none): the counts since the previous mark go to that phase,
+//  scaled up by enabled / running when the group shared the counters with
+//  other groups
+//
+void countPhase( int thread, int phase )
+{
+    phase_counters_t *c = &phaseCounters[thread];
+    if( c->state == 0 )
+    {
+        openCounters( c );
+        return;
+    }
+    unsigned long long values[COUNTERS], enabled, running;
+    if( c->state < 0 || !readCounters( c, values, &enabled, &running ) )
+        return;
+    if( phase >= 0 )
+    {
+        unsigned long long ran = running - c->lastRunning;
+        double scale = ran > 0 ? (double)( enabled - c->lastEnabled ) / ran : 0;
+        for( int k = 0; k < COUNTERS; k++ )
+            c->counts[phase][k] += scale * ( values[k] - c->last[k] );
+        c->pairs[phase] += forcePairs - c->lastPairs;
+    }
+    memcpy( c->last, values, sizeof(values) );
+    c->lastEnabled = enabled;
+    c->lastRunning = running;
+    c->lastPairs = forcePairs;
+}
+
+//
+//  counts of every phase summed over the threads, COUNTERS + 1 values per
+//  phase with the particle pairs last
+//
+void counterTotals( double *totals )
+{
+    memset( totals, 0, PHASES * ( COUNTERS + 1 ) * sizeof(double) );
+    for( int t = 0; phaseCounters && t < phaseThreads; t++ )
+        for( int p = 0; p < PHASES; p++ )
+        {
+            double *total = totals + p * ( COUNTERS + 1 );
+            for( int k = 0; k < COUNTERS; k++ )
+                total[k] += phaseCounters[t].counts[p][k];
+            total[COUNTERS] += phaseCounters[t].pairs[p];
+        }
+}
+
+void printCounterTotals( const double *totals, int timers, const char *unit )
+{
+    bool counted = false;
+    for( int p = 0; p < PHASES; p++ )
+        counted = counted || totals[p * ( COUNTERS + 1 ) + COUNTER_CYCLES] > 0;
+    if( !counted )
+    {
+        printf( "hardware counters: unavailable\n" );
+        return;
+    }
+    printf( "hardware counters over %d %s:\n", timers, unit );
+    printf( "  %-8s %14s %14s %5s", "", counterNames[COUNTER_CYCLES], counterNames[COUNTER_INSTRUCTIONS], "IPC" );
+    for( int k = COUNTER_L1D_MISSES; k < COUNTERS; k++ )
+        printf( " %13s", counterNames[k] );
+    printf( "\n" );
+    for( int p = 0; p < PHASES; p++ )
+    {
+        const double *total = totals + p * ( COUNTERS + 1 );
+        if( total[COUNTER_CYCLES] <= 0 )
+            continue;
+        printf( "  %-8s %14.0f %14.0f %5.2f", phaseNames[p], total[COUNTER_CYCLES], total[COUNTER_INSTRUCTIONS],
+                total[COUNTER_INSTRUCTIONS] / total[COUNTER_CYCLES] );
+        for( int k = COUNTER_L1D_MISSES; k < COUNTERS; k++ )
+            printf( " %13.0f", total[k] );
+        printf( "\n" );
+    }
+    for( int p = 0; p < PHASES; p++ )
+    {
+        const double *total = totals + p * ( COUNTERS + 1 );
+        double pairs = total[COUNTERS];
+        if( pairs > 0 )
+            printf( "  %s: %.0f particle pairs, %.2f cycles, %.2f instructions, %.4f L1D misses, %.5f LLC misses and %.4f branch misses per pair\n",
+                    phaseNames[p], pairs, total[COUNTER_CYCLES] / pairs, total[COUNTER_INSTRUCTIONS] / pairs,
+                    total[COUNTER_L1D_MISSES] / pairs, total[COUNTER_LLC_MISSES] / pairs, total[COUNTER_BRANCH_MISSES] / pairs );
+    }
+}
+
+//
+//  rings of capacity events (rounded up to a power of two) for the threads
+//  of initPhaseTimers, touched here so recording never faults pages in;
+//  times are taken from now
+//
+bool startTrace( int capacity )
+{
+#ifdef PHASE_TIMERS
+    long long size = 1;
+    while( size < capacity )
+        size *= 2;
+    traceMask = size - 1;
+    for( int t = 0; t < phaseThreads; t++ )
+    {
+        phaseTimers[t].events = (phase_event_t*) malloc( size * sizeof(phase_event_t) );
+        if( !phaseTimers[t].events )
+        {
+            fprintf( stderr, "cannot allocate trace rings of %lld events for %d threads\n", size, phaseThreads );
+            for( int k = 0; k < t; k++ )
+            {
+                free( phaseTimers[k].events );
+                phaseTimers[k].events = NULL;
+            }
+            return false;
+        }
+        memset( phaseTimers[t].events, 0, size * sizeof(phase_event_t) );
+        phaseTimers[t].recorded = 0;
+    }
+    traceOrigin = phaseClock( );
+    return true;
+#else
+    (void)capacity;
+    fprintf( stderr, "tracing needs the phase timers, build with -DPHASE_TIMERS\n" );
+    return false;
+#endif
+}
+
+//
+//  events still in the rings, thread by thread and oldest first
+//
+int collectTraceEvents( phase_event_t **events )
+{
+    long long total = 0;
+    for( int t = 0; t < phaseThreads; t++ )
+        if( phaseTimers[t].events )
+            total += phaseTimers[t].recorded < traceMask + 1 ? phaseTimers[t].recorded : traceMask + 1;
+    *events = (phase_event_t*) malloc( ( total > 0 ? total : 1 ) * sizeof(phase_event_t) );
+    int count = 0;
+    for( int t = 0; t < phaseThreads; t++ )
+    {
+        const phase_timer_t *timer = &phaseTimers[t];
+        if( !timer->events )
+            continue;
+        long long first = timer->recorded > traceMask + 1 ? timer->recorded - traceMask - 1 : 0;
+        for( long long k = first; k < timer->recorded; k++ )
+            (*events)[count++] = timer->events[k & traceMask];
+    }
+    return count;
+}
+
+trace_file_t *openTraceFile( const char *filename )
+{
+    FILE *f = fopen( filename, "w" );
+    if( !f )
+    {
+        fprintf( stderr, "cannot create trace %s\n", filename );
+        return NULL;
+    }
+    trace_file_t *trace = (trace_file_t*) calloc( 1, sizeof(trace_file_t) );
+    trace->f = f;
+    fprintf( f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" );
+    return trace;
+}
+
+static void nextTraceEvent( trace_file_t *trace )
+{
+    fputs( trace->events++ > 0 ? ",\n" : "\n", trace->f );
+}
+
+//
+//  complete events (ph X) in microseconds, process is the pid of the
+//  timeline and every thread a track of it
+//
+void writeTraceEvents( trace_file_t *trace, int process, const char *name, const phase_event_t *events, int count )
+{
+    FILE *f = trace->f;
+    nextTraceEvent( trace );
+    fprintf( f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}", process, name );
+    int thread = -1;
+    for( int i = 0; i < count; i++ )
+    {
+        const phase_event_t &e = events[i];
+        if( e.thread != thread )
+        {
+            thread = e.thread;
+            nextTraceEvent( trace );
+            fprintf( f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", process, thread, thread );
+        }
+        nextTraceEvent( trace );
+        fprintf( f, "{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                 e.phase >= 0 && e.phase < PHASES ? phaseNames[e.phase] : "unknown", process, e.thread, 1e6 * e.start, 1e6 * e.duration );
+    }
+}
+
+bool closeTraceFile( trace_file_t *trace )
+{
+    fprintf( trace->f, "\n]}\n" );
+    bool complete = fclose( trace->f ) == 0;
+    free( trace );
+    return complete;
+}
+
+//
+//  trace of the threads of this process
+//
+bool writeTrace( const char *filename )
+{
+    phase_event_t *events;
+    int count = collectTraceEvents( &events );
+    trace_file_t *trace = openTraceFile( filename );
+    bool complete = trace != NULL;
+    if( trace )
+    {
+        writeTraceEvents( trace, 0, "simulation", events, count );
+        complete = closeTraceFile( trace );
+        printf( "trace: %d phase events of %d threads written to %s\n", count, phaseThreads, filename );
+    }
+    free( events );
+    return complete;
+}
@@ -7,6 +7,12 @@
 #include <math.h>
 #include <pthread.h>
 #include "common.h"
+#include "trajectory.h"
+#include "checkpoint.h"
+#include "density.h"
+#include "stream.h"
+#include "selection.h"
+#include "phases.h"
 
 //
 //  global variables
@@ -15,6 +21,13 @@ int n;
 unsigned int n_threads;
 particle_t *particles;
 FILE *fsave;
+trajectory_t *trajectory;
+checkpoint_t *checkpoint;
+selection_t *selection;
+density_t *density;
+stream_t *stream;
+int checkpointfreq;
+int firstStep;
 pthread_barrier_t barrier;
 
 //
@@ -28,6 +41,7 @@ double interval;
 double cutoff = 0.01;
 int squareCounter = 0;
 int squaresToClear = 0;
+density_t *densityFrame = NULL;
 pthread_mutex_t countlock;
 pthread_mutex_t **squarelock;
 
@@ -51,6 +65,9 @@ void putInSquare(particle_t* particle){
         ny->next = rest;
     }
     squares[x][y].particles = ny;
+
+    if( densityFrame )
+        addToDensity( densityFrame, x, y, *particle );
 }
 
 //
@@ -67,18 +84,23 @@ void *thread_routine( void *pthread_id )
     //
     //  simulate a number of time steps
     //
-    for( int step = 0; step < NSTEPS; step++ )
+    for( int step = firstStep; step < NSTEPS; step++ )
     {
-
+        startPhase( thread_id, PHASE_BIN );
         if(thread_id == 0) {
             for (int i = 0; i < squaresToClear; i++) {
                 clearSquare(previousSquares[i]);
             }
+            densityFrame = density && (step%SAVEFREQ) == 0 ? density : NULL;
             for (int i = 0; i < n; i++) {
                 putInSquare(&particles[i]);
             }
+            if( densityFrame )
+                writeDensity( densityFrame, step );
         }
+        startPhase( thread_id, PHASE_BARRIER );
         pthread_barrier_wait( &barrier );
+        startPhase( thread_id, PHASE_FORCE );
         if(thread_id == 0){
             squaresToClear = squareCounter;
             squareCounter = 0;
@@ -88,22 +110,39 @@ void *thread_routine( void *pthread_id )
             applyForces(&particles[i], squares);
         }
 
+        startPhase( thread_id, PHASE_BARRIER );
         pthread_barrier_wait( &barrier );
 
         //
         //  move particles
         //
+        startPhase( thread_id, PHASE_MOVE );
         for( int i = first; i < last; i++ )
             move( particles[i] );
 
+        startPhase( thread_id, PHASE_BARRIER );
         pthread_barrier_wait( &barrier );
 
         //
         //  save if necessary
         //
+        startPhase( thread_id, PHASE_SAVE );
+        if( thread_id == 0 && selection && (step%SAVEFREQ) == 0 )
+            selectFromSquares( selection, squares, particles, n );
         if( thread_id == 0 && fsave && (step%SAVEFREQ) == 0 )
-            save( fsave, n, particles );
+            save( fsave, selection ? selection->count : n, selection ? selection->p : particles );
+        if( thread_id == 0 && trajectory && (step%SAVEFREQ) == 0 )
+            writeParticles( trajectory, step, selection ? selection->count : n, selection ? selection->p : particles );
+        if( thread_id == 0 && stream && (step%SAVEFREQ) == 0 )
+            publishFrame( stream, step, selection ? selection->count : n, selection ? selection->p : particles );
+
+        //
+        //  checkpoint the state the next step starts from
+        //
+        if( thread_id == 0 && checkpoint && (step+1)%checkpointfreq == 0 )
+            saveCheckpoint( checkpoint, step+1, particles );
     }
+    stopPhase( thread_id );
 
     return NULL;
 }
@@ -123,22 +162,82 @@ int main( int argc, char **argv )
         printf( "-n <int> to set the number of particles\n" );
         printf( "-p <int> to set the number of threads\n" );
         printf( "-o <filename> to specify the output file name\n" );
+        printf( "-text to write the legacy text format instead of a binary trajectory\n" );
+        printf( "-float to store the positions of the binary trajectory in single precision\n" );
+        printf( "-compress <int> to store positions quantized to that many bits and delta encoded\n" );
+        printf( "-async <int> to queue that many frames for the background writer thread, 0 to write synchronously\n" );
+        printf( "-direct <int> to write the trajectory and checkpoints with O_DIRECT through io_uring, that many writes in flight\n" );
+        printf( "-trace <filename> to write a Chrome trace of the phases of every thread (built with PHASE_TIMERS)\n" );
+        printf( "-tracecapacity <int> to keep only the last that many phase events per thread in the trace (default 65536)\n" );
+        printf( "-counters to count cycles, instructions and cache and branch misses of every phase with perf_event_open (built with PHASE_TIMERS)\n" );
+        printf( "-seed <int> to set the random seed of the initial configuration\n" );
+        printf( "-checkpoint <filename> to write the full state to that file in the background\n" );
+        printf( "-checkpointfreq <int> to checkpoint every that many steps (default 100)\n" );
+        printf( "-restart <filename> to continue from a checkpoint instead of a new configuration\n" );
+        printf( "-density <filename> to write the particle count and mean velocity per cell of a coarse grid every SAVEFREQ steps\n" );
+        printf( "-densitycells <int> to set the cells per side of that grid (default 32)\n" );
+        printf( "-sample <int> to save only every k-th particle\n" );
+        printf( "-window <x0,y0,x1,y1> to save only the particles inside that rectangle (binary trajectories only)\n" );
+        printf( "-stream <name> to publish the saved frames in shared memory for watch and other live readers\n" );
+        printf( "-streamslots <int> to set the number of frames kept for those readers (default 4)\n" );
         return 0;
     }
 
     n = read_int( argc, argv, "-n", 1000 );
+
+    //
+    //  a restart takes the number of particles from the checkpoint
+    //
+    char *restartname = read_string( argc, argv, "-restart", NULL );
+    checkpoint_header_t restart;
+    if( restartname )
+    {
+        if( !readCheckpointHeader( restartname, &restart ) )
+            return 1;
+        n = (int)restart.n;
+    }
     n_threads = static_cast<unsigned int>(read_int(argc, argv, "-p", 2 ));
     char *savename = read_string( argc, argv, "-o", NULL );
 
     //
     //  allocate resources
     //
-    fsave = savename ? fopen( savename, "w" ) : NULL;
+    bool text = find_option( argc, argv, "-text" ) >= 0;
+    fsave = savename && text ? fopen( savename, "w" ) : NULL;
 
     printf("PTHREADS RUN");
     particles = (particle_t*) malloc( n * sizeof(particle_t) );
     set_size( n );
-    init_particles( n, particles );
+    firstStep = 0;
+    if( restartname )
+    {
+        set_seed( restart.seed );
+        if( !readCheckpoint( restartname, 0, n, particles ) )
+            return 1;
+        firstStep = (int)restart.step;
+    }else {
+        if( find_option( argc, argv, "-seed" ) >= 0 )
+            set_seed( read_int( argc, argv, "-seed", 0 ) );
+        init_particles( n, particles );
+    }
+    char *checkpointname = read_string( argc, argv, "-checkpoint", NULL );
+    checkpointfreq = max( read_int( argc, argv, "-checkpointfreq", 100 ), 1 );
+    checkpoint = checkpointname ? startCheckpoints( checkpointname, n ) : NULL;
+    selection = readSelection( argc, argv, n );
+    trajectory = savename && !text ? openTrajectory( savename, selection ? selection->capacity : n, find_option( argc, argv, "-float" ) >= 0 ? sizeof(float) : sizeof(double), read_int( argc, argv, "-async", 2 ) ) : NULL;
+    if( trajectory && selection && selection->window )
+        countTrajectory( trajectory );
+    if( trajectory && find_option( argc, argv, "-compress" ) >= 0 )
+        compressTrajectory( trajectory, read_int( argc, argv, "-compress", 20 ) );
+    if( trajectory && find_option( argc, argv, "-direct" ) >= 0 )
+        directTrajectory( trajectory, savename, read_int( argc, argv, "-direct", 8 ) );
+    if( checkpoint && find_option( argc, argv, "-direct" ) >= 0 )
+        directCheckpoints( checkpoint, read_int( argc, argv, "-direct", 8 ) );
+
+    char *densityname = read_string( argc, argv, "-density", NULL );
+    density = densityname ? openDensity( densityname, n, read_int( argc, argv, "-densitycells", 32 ) ) : NULL;
+    char *streamname = read_string( argc, argv, "-stream", NULL );
+    stream = streamname ? openStream( streamname, selection ? selection->capacity : n, read_int( argc, argv, "-streamslots", 4 ) ) : NULL;
 
     int sizesteps = getSizesteps();
     interval = getIntervall();
@@ -167,6 +266,12 @@ int main( int argc, char **argv )
     pthread_t *threads = (pthread_t *) malloc( n_threads * sizeof( pthread_t ) );
 
     printf("NUMBER OF THREADS = %d\n", n_threads);
+    initPhaseTimers( n_threads );
+    char *tracename = read_string( argc, argv, "-trace", NULL );
+    if( tracename && !startTrace( read_int( argc, argv, "-tracecapacity", 65536 ) ) )
+        tracename = NULL;
+    if( find_option( argc, argv, "-counters" ) >= 0 )
+        startCounters( );
     //
     //  do the parallel work
     //
@@ -181,6 +286,9 @@ int main( int argc, char **argv )
     simulation_time = read_timer( ) - simulation_time;
 
     printf( "n = %d, n_threads = %d, simulation time = %g seconds\n", n, n_threads, simulation_time );
+    printPhaseTimers( );
+    if( tracename )
+        writeTrace( tracename );
 
     //
     //  release resources
@@ -197,6 +305,17 @@ int main( int argc, char **argv )
     free( particles );
     if( fsave )
         fclose( fsave );
+    if( trajectory )
+        closeTrajectory( trajectory );
+    if( checkpoint )
+        stopCheckpoints( checkpoint );
+    if( density )
+        closeDensity( density );
+    if( stream )
+        closeStream( stream );
+    if( selection )
+        freeSelection( selection );
+    freePhaseTimers( );
 
     return 0;
 }
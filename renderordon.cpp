@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef USE_PNG
+#include <png.h>
+#endif
+#include "common.h"
+#include "trajectorymap.h"
+
+//
+//  same picture as visualize: a grey box around [0, size]^2 with a margin
+//  of eps and one black pixel per particle on white, SCALE pixels per unit
+//
+#define eps 0.1
+#define SCALE 200
+#define MIN_SIZE 100
+#define BLOCK 256
+
+const unsigned char WHITE = 255, GREY = 191, BLACK = 0;
+
+trajectory_map_t *trajectory;
+int width, firstFrame, lastFrame, every, nthreads;
+bool png;
+char *prefix;
+
+//
+//  one image per thread, one byte per pixel; the byte after the last pixel
+//  takes the particles that fall outside the picture
+//
+typedef struct
+{
+    int thread;
+    frame_view_t view;
+    unsigned char *pixels;
+    unsigned char *row;
+    size_t *target;
+    int frames;
+} renderer_t;
+
+//
+//  pixel of every particle of a block, computed without branches so the
+//  compiler can vectorize it, then set in a separate scatter loop
+//
+template <typename T> void splat( const T *xy, int count, unsigned char *pixels, size_t *target )
+{
+    const float scale = width / ( trajectory->size + 2 * eps );
+    const size_t outside = (size_t)width * width;
+    for( int start = 0; start < count; start += BLOCK )
+    {
+        int block = min( BLOCK, count - start );
+        const T *p = xy + 2 * start;
+        for( int i = 0; i < block; i++ )
+        {
+            int column = (int)( ( (float)p[2*i] + (float)eps ) * scale );
+            int row = width - 1 - (int)( ( (float)p[2*i+1] + (float)eps ) * scale );
+            bool inside = (unsigned)column < (unsigned)width && (unsigned)row < (unsigned)width;
+            target[i] = inside ? (size_t)row * width + column : outside;
+        }
+        for( int i = 0; i < block; i++ )
+            pixels[target[i]] = BLACK;
+    }
+}
+
+static void drawBox( unsigned char *pixels )
+{
+    int low = (int)( eps * width / ( trajectory->size + 2 * eps ) );
+    int high = min( width - 1 - low, width - 1 );
+    for( int i = low; i <= high; i++ )
+    {
+        pixels[(size_t)low * width + i] = pixels[(size_t)high * width + i] = GREY;
+        pixels[(size_t)i * width + low] = pixels[(size_t)i * width + high] = GREY;
+    }
+}
+
+static bool writePPM( const char *filename, renderer_t *r )
+{
+    FILE *f = fopen( filename, "wb" );
+    if( !f )
+        return false;
+    fprintf( f, "P6\n%d %d\n255\n", width, width );
+    bool complete = true;
+    for( int y = 0; y < width && complete; y++ )
+    {
+        const unsigned char *pixel = r->pixels + (size_t)y * width;
+        for( int x = 0; x < width; x++ )
+            r->row[3*x] = r->row[3*x+1] = r->row[3*x+2] = pixel[x];
+        complete = fwrite( r->row, 3, width, f ) == (size_t)width;
+    }
+    return fclose( f ) == 0 && complete;
+}
+
+#ifdef USE_PNG
+static bool writePNG( const char *filename, renderer_t *r )
+{
+    FILE *f = fopen( filename, "wb" );
+    if( !f )
+        return false;
+    png_structp png = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+    png_infop info = png ? png_create_info_struct( png ) : NULL;
+    if( !info || setjmp( png_jmpbuf( png ) ) )
+    {
+        png_destroy_write_struct( &png, &info );
+        fclose( f );
+        return false;
+    }
+    png_init_io( png, f );
+    png_set_compression_level( png, 1 );
+    png_set_IHDR( png, info, width, width, 8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
+                  PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT );
+    png_write_info( png, info );
+    for( int y = 0; y < width; y++ )
+        png_write_row( png, r->pixels + (size_t)y * width );
+    png_write_end( png, NULL );
+    png_destroy_write_struct( &png, &info );
+    return fclose( f ) == 0;
+}
+#endif
+
+static void renderFrame( renderer_t *r, int frame, char *filename )
+{
+    if( !viewFrame( trajectory, frame, &r->view ) )
+    {
+        fprintf( stderr, "frame %d is truncated\n", frame );
+        return;
+    }
+    memset( r->pixels, WHITE, (size_t)width * width );
+    drawBox( r->pixels );
+    if( r->view.precision == sizeof(float) )
+        splat( (const float*) r->view.xy, r->view.n, r->pixels, r->target );
+    else
+        splat( (const double*) r->view.xy, r->view.n, r->pixels, r->target );
+
+    sprintf( filename, "%s%06d.%s", prefix, frame, png ? "png" : "ppm" );
+#ifdef USE_PNG
+    bool written = png ? writePNG( filename, r ) : writePPM( filename, r );
+#else
+    bool written = writePPM( filename, r );
+#endif
+    if( !written )
+        fprintf( stderr, "failed to write %s\n", filename );
+    r->frames++;
+}
+
+//
+//  raw and text frames are viewed in place, so the frames are dealt out
+//  one by one: first + thread * every, first + (thread + nthreads) * every,
+//  ...; a delta frame is decoded from the keyframe before it, so whole
+//  keyframe groups are dealt out instead and every thread decodes only the
+//  frames of its own groups, each once
+//
+void *render_routine( void *arg )
+{
+    renderer_t *r = (renderer_t*) arg;
+    char *filename = (char*) malloc( strlen( prefix ) + 16 );
+    if( trajectory->format == MAP_BINARY && trajectory->header.encoding == TRAJECTORY_DELTA )
+    {
+        int keyframes = trajectory->header.keyframes;
+        for( int group = firstFrame / keyframes + r->thread; group * keyframes <= lastFrame; group += nthreads )
+        {
+            int frame = max( group * keyframes, firstFrame );
+            frame += ( every - ( frame - firstFrame ) % every ) % every;
+            for( ; frame < ( group + 1 ) * keyframes && frame <= lastFrame; frame += every )
+                renderFrame( r, frame, filename );
+        }
+    }else {
+        for( int frame = firstFrame + r->thread * every; frame <= lastFrame; frame += nthreads * every )
+            renderFrame( r, frame, filename );
+    }
+    free( filename );
+    return NULL;
+}
+
+//
+//  renders a trajectory (binary, or the text output of -text) to one image
+//  per frame without a display, several frames at a time
+//
+int main( int argc, char **argv )
+{
+    if( find_option( argc, argv, "-h" ) >= 0 || find_option( argc, argv, "-i" ) < 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-i <filename> to specify the trajectory to render (binary or text)\n" );
+        printf( "-o <prefix> to specify the image file names, <prefix><frame>.ppm (default: frame)\n" );
+        printf( "-s <int> to set the width and height of the images in pixels\n" );
+        printf( "-first <int> and -last <int> to render only those frames\n" );
+        printf( "-every <int> to render only every k-th frame\n" );
+        printf( "-p <int> to set the number of threads (default: all processors)\n" );
+#ifdef USE_PNG
+        printf( "-png to write PNG instead of PPM images\n" );
+#endif
+        return 0;
+    }
+
+    char *inname = read_string( argc, argv, "-i", NULL );
+    prefix = read_string( argc, argv, "-o", (char*)"frame" );
+    nthreads = read_int( argc, argv, "-p", (int)sysconf( _SC_NPROCESSORS_ONLN ) );
+    nthreads = max( nthreads, 1 );
+    every = max( read_int( argc, argv, "-every", 1 ), 1 );
+#ifdef USE_PNG
+    png = find_option( argc, argv, "-png" ) >= 0;
+#else
+    if( find_option( argc, argv, "-png" ) >= 0 )
+        fprintf( stderr, "built without libpng, writing PPM\n" );
+#endif
+
+    trajectory = mapTrajectory( inname, nthreads );
+    if( !trajectory )
+        return 1;
+    firstFrame = max( read_int( argc, argv, "-first", 0 ), 0 );
+    lastFrame = min( read_int( argc, argv, "-last", trajectory->frames - 1 ), trajectory->frames - 1 );
+    width = (int)( ( trajectory->size + 2 * eps ) * SCALE );
+    width = max( read_int( argc, argv, "-s", max( width, MIN_SIZE ) ), 1 );
+
+    double render_time = read_timer( );
+
+    renderer_t *renderers = (renderer_t*) calloc( nthreads, sizeof(renderer_t) );
+    pthread_t *threads = (pthread_t*) malloc( nthreads * sizeof(pthread_t) );
+    for( int t = 0; t < nthreads; t++ )
+    {
+        renderer_t *r = &renderers[t];
+        r->thread = t;
+        initFrameView( &r->view );
+        r->pixels = (unsigned char*) malloc( (size_t)width * width + 1 );
+        r->row = (unsigned char*) malloc( 3 * width );
+        r->target = (size_t*) malloc( BLOCK * sizeof(size_t) );
+        if( t > 0 )
+            pthread_create( &threads[t], NULL, render_routine, r );
+    }
+    render_routine( &renderers[0] );
+
+    int frames = renderers[0].frames;
+    for( int t = 1; t < nthreads; t++ )
+    {
+        pthread_join( threads[t], NULL );
+        frames += renderers[t].frames;
+    }
+
+    render_time = read_timer( ) - render_time;
+    printf( "%d frames of %d particles, %d x %d, rendered in %g seconds (%g frames/s) with %d threads\n",
+            frames, trajectory->n, width, width, render_time, render_time > 0 ? frames / render_time : 0.0, nthreads );
+
+    for( int t = 0; t < nthreads; t++ )
+    {
+        freeFrameView( &renderers[t].view );
+        free( renderers[t].pixels );
+        free( renderers[t].row );
+        free( renderers[t].target );
+    }
+    free( renderers );
+    free( threads );
+    unmapTrajectory( trajectory );
+
+    return 0;
+}
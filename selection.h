@@ -0,0 +1,47 @@
+#ifndef __CS267_SELECTION_H__
+#define __CS267_SELECTION_H__
+
+#include "common.h"
+
+//
+//  particles written at save steps: every k-th by index, the same ones in
+//  every frame, and/or the ones inside a window, whose number changes from
+//  frame to frame; the window is looked up in the cell grid, so only the
+//  particles in the cells it overlaps are visited
+//
+typedef struct
+{
+    int every;
+    bool window;
+    double x0, y0, x1, y1;
+
+    //
+    //  cells [cx0, cx1) x [cy0, cy1) overlap the window or lie next to it,
+    //  for the particles that moved into it since they were binned
+    //
+    int cx0, cx1, cy0, cy1;
+
+    //
+    //  at most capacity particles are selected
+    //
+    int capacity;
+    particle_t *p;
+    int count;
+} selection_t;
+
+selection_t *readSelection( int argc, char **argv, int n );
+void freeSelection( selection_t *s );
+
+inline bool inWindow( const selection_t *s, const particle_t &p )
+{
+    return !s->window || ( p.x >= s->x0 && p.x < s->x1 && p.y >= s->y0 && p.y < s->y1 );
+}
+
+//
+//  the selection among n particles binned into linked lists of squares or
+//  (sorted) into cells cx * sizesteps + cy, which start at cellStart
+//
+void selectFromSquares( selection_t *s, square_t **squares, particle_t *particles, int n );
+void selectFromCells( selection_t *s, const int *cellStart, const int *order, particle_t *particles, int n );
+
+#endif
@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "selection.h"
+
+//
+//  -sample <k> and -window <x0,y0,x1,y1>, NULL if neither is given
+//
+selection_t *readSelection( int argc, char **argv, int n )
+{
+    int every = max( read_int( argc, argv, "-sample", 1 ), 1 );
+    char *window = read_string( argc, argv, "-window", NULL );
+    if( window && find_option( argc, argv, "-text" ) >= 0 )
+    {
+        fprintf( stderr, "-window needs a binary trajectory, ignored with -text\n" );
+        window = NULL;
+    }
+    if( every == 1 && !window )
+        return NULL;
+
+    selection_t *s = (selection_t*) calloc( 1, sizeof(selection_t) );
+    s->every = every;
+    if( window )
+    {
+        if( sscanf( window, "%lf,%lf,%lf,%lf", &s->x0, &s->y0, &s->x1, &s->y1 ) != 4 )
+        {
+            fprintf( stderr, "-window takes x0,y0,x1,y1, not %s\n", window );
+            free( s );
+            return NULL;
+        }
+        s->window = true;
+        int sizesteps = getSizesteps( );
+        s->cx0 = max( getCell( s->x0 > 0 ? s->x0 : 0 ) - 1, 0 );
+        s->cy0 = max( getCell( s->y0 > 0 ? s->y0 : 0 ) - 1, 0 );
+        s->cx1 = min( getCell( s->x1 > 0 ? s->x1 : 0 ) + 2, sizesteps );
+        s->cy1 = min( getCell( s->y1 > 0 ? s->y1 : 0 ) + 2, sizesteps );
+    }
+    s->capacity = s->window ? n : ( n + every - 1 ) / every;
+    s->p = (particle_t*) malloc( max( s->capacity, 1 ) * sizeof(particle_t) );
+    return s;
+}
+
+void freeSelection( selection_t *s )
+{
+    free( s->p );
+    free( s );
+}
+
+//
+//  without a window every k-th particle is taken directly
+//
+static bool selectSample( selection_t *s, particle_t *particles, int n )
+{
+    if( s->window )
+        return false;
+    s->count = 0;
+    for( int i = 0; i < n; i += s->every )
+        s->p[s->count++] = particles[i];
+    return true;
+}
+
+void selectFromSquares( selection_t *s, square_t **squares, particle_t *particles, int n )
+{
+    if( selectSample( s, particles, n ) )
+        return;
+    s->count = 0;
+    for( int cx = s->cx0; cx < s->cx1; cx++ )
+        for( int cy = s->cy0; cy < s->cy1; cy++ )
+            for( particle_node_t *node = squares[cx][cy].particles; node != nullptr; node = node->next )
+                if( ( node->p - particles ) % s->every == 0 && inWindow( s, *node->p ) )
+                    s->p[s->count++] = *node->p;
+}
+
+void selectFromCells( selection_t *s, const int *cellStart, const int *order, particle_t *particles, int n )
+{
+    if( selectSample( s, particles, n ) )
+        return;
+    int sizesteps = getSizesteps( );
+    s->count = 0;
+    for( int cx = s->cx0; cx < s->cx1; cx++ )
+        for( int k = cellStart[cx * sizesteps + s->cy0]; k < cellStart[cx * sizesteps + s->cy1]; k++ )
+        {
+            int i = order[k];
+            if( i % s->every == 0 && inWindow( s, particles[i] ) )
+                s->p[s->count++] = particles[i];
+        }
+}
@@ -3,12 +3,19 @@
 #include <assert.h>
 #include <math.h>
 #include "common.h"
+#include "trajectory.h"
+#include "checkpoint.h"
+#include "density.h"
+#include "stream.h"
+#include "selection.h"
+#include "phases.h"
 
 square_t **squares;
 square_t **previousSquares;
 double interval;
 double cutoff = 0.01;
 int squareCounter = 0;
+density_t *densityFrame = NULL;
 
 void putInSquare(particle_t* particle){
     int x;
@@ -30,6 +37,9 @@ void putInSquare(particle_t* particle){
         ny->next = rest;
     }
     squares[x][y].particles = ny;
+
+    if( densityFrame )
+        addToDensity( densityFrame, x, y, *particle );
 }
 //
 //  benchmarking program
@@ -42,6 +52,24 @@ int main( int argc, char **argv )
         printf( "-h to see this help\n" );
         printf( "-n <int> to set the number of particles\n" );
         printf( "-o <filename> to specify the output file name\n" );
+        printf( "-text to write the legacy text format instead of a binary trajectory\n" );
+        printf( "-float to store the positions of the binary trajectory in single precision\n" );
+        printf( "-compress <int> to store positions quantized to that many bits and delta encoded\n" );
+        printf( "-async <int> to queue that many frames for the background writer thread, 0 to write synchronously\n" );
+        printf( "-direct <int> to write the trajectory and checkpoints with O_DIRECT through io_uring, that many writes in flight\n" );
+        printf( "-trace <filename> to write a Chrome trace of the phases of every thread (built with PHASE_TIMERS)\n" );
+        printf( "-tracecapacity <int> to keep only the last that many phase events per thread in the trace (default 65536)\n" );
+        printf( "-counters to count cycles, instructions and cache and branch misses of every phase with perf_event_open (built with PHASE_TIMERS)\n" );
+        printf( "-seed <int> to set the random seed of the initial configuration\n" );
+        printf( "-checkpoint <filename> to write the full state to that file in the background\n" );
+        printf( "-checkpointfreq <int> to checkpoint every that many steps (default 100)\n" );
+        printf( "-restart <filename> to continue from a checkpoint instead of a new configuration\n" );
+        printf( "-density <filename> to write the particle count and mean velocity per cell of a coarse grid every SAVEFREQ steps\n" );
+        printf( "-densitycells <int> to set the cells per side of that grid (default 32)\n" );
+        printf( "-sample <int> to save only every k-th particle\n" );
+        printf( "-window <x0,y0,x1,y1> to save only the particles inside that rectangle (binary trajectories only)\n" );
+        printf( "-stream <name> to publish the saved frames in shared memory for watch and other live readers\n" );
+        printf( "-streamslots <int> to set the number of frames kept for those readers (default 4)\n" );
         return 0;
     }
 
@@ -49,12 +77,54 @@ int main( int argc, char **argv )
 
     int n = read_int( argc, argv, "-n", 1000 );
 
-    char *savename = read_string(argc, argv, "-o", const_cast<char *>("data"));
+    //
+    //  a restart takes the number of particles from the checkpoint
+    //
+    char *restartname = read_string( argc, argv, "-restart", NULL );
+    checkpoint_header_t restart;
+    if( restartname )
+    {
+        if( !readCheckpointHeader( restartname, &restart ) )
+            return 1;
+        n = (int)restart.n;
+    }
+
+    char *densityname = read_string( argc, argv, "-density", NULL );
+    char *streamname = read_string( argc, argv, "-stream", NULL );
+    char *savename = read_string(argc, argv, "-o", densityname || streamname ? NULL : const_cast<char *>("data"));
 
-    FILE *fsave = savename ? fopen( savename, "w" ) : NULL;
+    bool text = find_option( argc, argv, "-text" ) >= 0;
+    FILE *fsave = savename && text ? fopen( savename, "w" ) : NULL;
     particle_t *particles = (particle_t*) malloc( n * sizeof(particle_t) );
     set_size( n );
-    init_particles( n, particles );
+    int firstStep = 0;
+    if( restartname )
+    {
+        set_seed( restart.seed );
+        if( !readCheckpoint( restartname, 0, n, particles ) )
+            return 1;
+        firstStep = (int)restart.step;
+    }else {
+        if( find_option( argc, argv, "-seed" ) >= 0 )
+            set_seed( read_int( argc, argv, "-seed", 0 ) );
+        init_particles( n, particles );
+    }
+    char *checkpointname = read_string( argc, argv, "-checkpoint", NULL );
+    int checkpointfreq = max( read_int( argc, argv, "-checkpointfreq", 100 ), 1 );
+    checkpoint_t *checkpoint = checkpointname ? startCheckpoints( checkpointname, n ) : NULL;
+    selection_t *selection = readSelection( argc, argv, n );
+    trajectory_t *trajectory = savename && !text ? openTrajectory( savename, selection ? selection->capacity : n, find_option( argc, argv, "-float" ) >= 0 ? sizeof(float) : sizeof(double), read_int( argc, argv, "-async", 2 ) ) : NULL;
+    if( trajectory && selection && selection->window )
+        countTrajectory( trajectory );
+    if( trajectory && find_option( argc, argv, "-compress" ) >= 0 )
+        compressTrajectory( trajectory, read_int( argc, argv, "-compress", 20 ) );
+    if( trajectory && find_option( argc, argv, "-direct" ) >= 0 )
+        directTrajectory( trajectory, savename, read_int( argc, argv, "-direct", 8 ) );
+    if( checkpoint && find_option( argc, argv, "-direct" ) >= 0 )
+        directCheckpoints( checkpoint, read_int( argc, argv, "-direct", 8 ) );
+
+    density_t *density = densityname ? openDensity( densityname, n, read_int( argc, argv, "-densitycells", 32 ) ) : NULL;
+    stream_t *stream = streamname ? openStream( streamname, selection ? selection->capacity : n, read_int( argc, argv, "-streamslots", 4 ) ) : NULL;
 
     int sizesteps = getSizesteps();
     interval = getIntervall();
@@ -74,16 +144,30 @@ int main( int argc, char **argv )
     double simulation_time = read_timer( );
 
     printf("NUMBER OF THREADS = %d\n", 1);
-    for( int step = 0; step < NSTEPS; step++ )
+    initPhaseTimers( 1 );
+    char *tracename = read_string( argc, argv, "-trace", NULL );
+    if( tracename && !startTrace( read_int( argc, argv, "-tracecapacity", 65536 ) ) )
+        tracename = NULL;
+    if( find_option( argc, argv, "-counters" ) >= 0 )
+        startCounters( );
+    for( int step = firstStep; step < NSTEPS; step++ )
     {
+        startPhase( 0, PHASE_BIN );
         for(int i = 0; i < squaresToClear; i++) {
             clearSquare(previousSquares[i]);
         }
+        //
+        //  collect the density field of save steps while binning
+        //
+        densityFrame = density && (step%SAVEFREQ) == 0 ? density : NULL;
         //Barrier will be needed when parallel
         for(int i = 0; i < n; i++ ){
             putInSquare(&particles[i]);
         }
+        if( densityFrame )
+            writeDensity( densityFrame, step );
         //Barrier will be needed when parallel
+        startPhase( 0, PHASE_FORCE );
         for(int i = 0; i < n; i++){
             applyForces(&particles[i], squares);
         }
@@ -93,18 +177,36 @@ int main( int argc, char **argv )
         //
         //  move particles
         //
+        startPhase( 0, PHASE_MOVE );
         for( int i = 0; i < n; i++ )
             move( particles[i] );
 
         //
         //  save if necessary
         //
+        startPhase( 0, PHASE_SAVE );
+        if( selection && (step%SAVEFREQ) == 0 )
+            selectFromSquares( selection, squares, particles, n );
         if( fsave && (step%SAVEFREQ) == 0 )
-            save( fsave, n, particles );
+            save( fsave, selection ? selection->count : n, selection ? selection->p : particles );
+        if( trajectory && (step%SAVEFREQ) == 0 )
+            writeParticles( trajectory, step, selection ? selection->count : n, selection ? selection->p : particles );
+        if( stream && (step%SAVEFREQ) == 0 )
+            publishFrame( stream, step, selection ? selection->count : n, selection ? selection->p : particles );
+
+        //
+        //  checkpoint the state the next step starts from
+        //
+        if( checkpoint && (step+1)%checkpointfreq == 0 )
+            saveCheckpoint( checkpoint, step+1, particles );
     }
+    stopPhase( 0 );
     simulation_time = read_timer( ) - simulation_time;
 
     printf( "\nn = %d, simulation time = %g seconds\n", n, simulation_time );
+    printPhaseTimers( );
+    if( tracename )
+        writeTrace( tracename );
 
     for(int i = 0; i < sizesteps; i++){
         free(squares[i]);
@@ -114,6 +216,17 @@ int main( int argc, char **argv )
     free( particles );
     if( fsave )
         fclose( fsave );
+    if( trajectory )
+        closeTrajectory( trajectory );
+    if( checkpoint )
+        stopCheckpoints( checkpoint );
+    if( density )
+        closeDensity( density );
+    if( stream )
+        closeStream( stream );
+    if( selection )
+        freeSelection( selection );
+    freePhaseTimers( );
 
     return 0;
 }
@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+#include <execution>
+#include <numeric>
+#include "common.h"
+#include "trajectory.h"
+#include "checkpoint.h"
+#include "density.h"
+#include "stream.h"
+#include "selection.h"
+#include "phases.h"
+
+//
+//  particles are binned by sorting an index array on the cell key instead of
+//  building linked lists, so every phase maps onto a parallel algorithm
+//
+int *cellOf;
+int *order;
+int *sortedCells;
+int *cellStart;
+double interval;
+int cellsteps;
+
+void applyForcesSorted(particle_t *particles, int i){
+    particle_t &particle = particles[i];
+    int x = cellOf[i] / cellsteps;
+    int y = cellOf[i] % cellsteps;
+    particle.ax = particle.ay = 0;
+
+    int tempX, tempY;
+    int maxX, maxY;
+    if(x > 0) tempX = x - 1; else tempX = x;
+    if(y > 0) tempY = y - 1; else tempY = y;
+    if(x < cellsteps - 1) maxX = x + 2; else maxX = cellsteps;
+    if(y < cellsteps - 1) maxY = y + 2; else maxY = cellsteps;
+
+    //
+    //  cells (cx, tempY..maxY-1) are contiguous in the sorted order
+    //
+    for (int cx = tempX; cx < maxX; cx++) {
+        int first = cellStart[cx * cellsteps + tempY];
+        int last = cellStart[cx * cellsteps + maxY];
+        for (int k = first; k < last; k++)
+            apply_force(particle, particles[order[k]]);
+    }
+}
+
+//
+//  particle pairs the force loop looked at, the particles in the cell
+//  neighbourhood of every particle; counted afterwards on the calling
+//  thread so the unsequenced loop stays as it is
+//
+long long pairsSorted(int n){
+    long long pairs = 0;
+    for (int i = 0; i < n; i++) {
+        int x = cellOf[i] / cellsteps;
+        int y = cellOf[i] % cellsteps;
+        int tempX = x > 0 ? x - 1 : x, maxX = x < cellsteps - 1 ? x + 2 : cellsteps;
+        int tempY = y > 0 ? y - 1 : y, maxY = y < cellsteps - 1 ? y + 2 : cellsteps;
+        for (int cx = tempX; cx < maxX; cx++)
+            pairs += cellStart[cx * cellsteps + maxY] - cellStart[cx * cellsteps + tempY];
+    }
+    return pairs;
+}
+
+//
+//  benchmarking program
+//
+int main( int argc, char **argv )
+{
+    if( find_option( argc, argv, "-h" ) >= 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-n <int> to set the number of particles\n" );
+        printf( "-o <filename> to specify the output file name\n" );
+        printf( "-text to write the legacy text format instead of a binary trajectory\n" );
+        printf( "-float to store the positions of the binary trajectory in single precision\n" );
+        printf( "-compress <int> to store positions quantized to that many bits and delta encoded\n" );
+        printf( "-async <int> to queue that many frames for the background writer thread, 0 to write synchronously\n" );
+        printf( "-direct <int> to write the trajectory and checkpoints with O_DIRECT through io_uring, that many writes in flight\n" );
+        printf( "-trace <filename> to write a Chrome trace of the phases of every thread (built with PHASE_TIMERS)\n" );
+        printf( "-tracecapacity <int> to keep only the last that many phase events per thread in the trace (default 65536)\n" );
+        printf( "-counters to count cycles, instructions and cache and branch misses of every phase with perf_event_open (built with PHASE_TIMERS)\n" );
+        printf( "-seed <int> to set the random seed of the initial configuration\n" );
+        printf( "-checkpoint <filename> to write the full state to that file in the background\n" );
+        printf( "-checkpointfreq <int> to checkpoint every that many steps (default 100)\n" );
+        printf( "-restart <filename> to continue from a checkpoint instead of a new configuration\n" );
+        printf( "-density <filename> to write the particle count and mean velocity per cell of a coarse grid every SAVEFREQ steps\n" );
+        printf( "-densitycells <int> to set the cells per side of that grid (default 32)\n" );
+        printf( "-sample <int> to save only every k-th particle\n" );
+        printf( "-window <x0,y0,x1,y1> to save only the particles inside that rectangle (binary trajectories only)\n" );
+        printf( "-stream <name> to publish the saved frames in shared memory for watch and other live readers\n" );
+        printf( "-streamslots <int> to set the number of frames kept for those readers (default 4)\n" );
+        return 0;
+    }
+
+    printf("PARALLEL STL RUN");
+
+    int n = read_int( argc, argv, "-n", 1000 );
+
+    //
+    //  a restart takes the number of particles from the checkpoint
+    //
+    char *restartname = read_string( argc, argv, "-restart", NULL );
+    checkpoint_header_t restart;
+    if( restartname )
+    {
+        if( !readCheckpointHeader( restartname, &restart ) )
+            return 1;
+        n = (int)restart.n;
+    }
+
+    char *densityname = read_string( argc, argv, "-density", NULL );
+    char *streamname = read_string( argc, argv, "-stream", NULL );
+    char *savename = read_string(argc, argv, "-o", densityname || streamname ? NULL : const_cast<char *>("data"));
+
+    bool text = find_option( argc, argv, "-text" ) >= 0;
+    FILE *fsave = savename && text ? fopen( savename, "w" ) : NULL;
+    particle_t *particles = (particle_t*) malloc( n * sizeof(particle_t) );
+    set_size( n );
+    int firstStep = 0;
+    if( restartname )
+    {
+        set_seed( restart.seed );
+        if( !readCheckpoint( restartname, 0, n, particles ) )
+            return 1;
+        firstStep = (int)restart.step;
+    }else {
+        if( find_option( argc, argv, "-seed" ) >= 0 )
+            set_seed( read_int( argc, argv, "-seed", 0 ) );
+        init_particles( n, particles );
+    }
+    char *checkpointname = read_string( argc, argv, "-checkpoint", NULL );
+    int checkpointfreq = max( read_int( argc, argv, "-checkpointfreq", 100 ), 1 );
+    checkpoint_t *checkpoint = checkpointname ? startCheckpoints( checkpointname, n ) : NULL;
+    selection_t *selection = readSelection( argc, argv, n );
+    trajectory_t *trajectory = savename && !text ? openTrajectory( savename, selection ? selection->capacity : n, find_option( argc, argv, "-float" ) >= 0 ? sizeof(float) : sizeof(double), read_int( argc, argv, "-async", 2 ) ) : NULL;
+    if( trajectory && selection && selection->window )
+        countTrajectory( trajectory );
+    if( trajectory && find_option( argc, argv, "-compress" ) >= 0 )
+        compressTrajectory( trajectory, read_int( argc, argv, "-compress", 20 ) );
+    if( trajectory && find_option( argc, argv, "-direct" ) >= 0 )
+        directTrajectory( trajectory, savename, read_int( argc, argv, "-direct", 8 ) );
+    if( checkpoint && find_option( argc, argv, "-direct" ) >= 0 )
+        directCheckpoints( checkpoint, read_int( argc, argv, "-direct", 8 ) );
+
+    density_t *density = densityname ? openDensity( densityname, n, read_int( argc, argv, "-densitycells", 32 ) ) : NULL;
+    stream_t *stream = streamname ? openStream( streamname, selection ? selection->capacity : n, read_int( argc, argv, "-streamslots", 4 ) ) : NULL;
+
+    cellsteps = getSizesteps();
+    interval = getIntervall();
+    int cells = cellsteps * cellsteps;
+
+    cellOf = (int*) malloc(n * sizeof(int));
+    order = (int*) malloc(n * sizeof(int));
+    sortedCells = (int*) malloc(n * sizeof(int));
+    cellStart = (int*) malloc((cells + 1) * sizeof(int));
+    int *cellIds = (int*) malloc((cells + 1) * sizeof(int));
+    std::iota(cellIds, cellIds + cells + 1, 0);
+
+    //
+    //  simulate a number of time steps
+    //
+    double simulation_time = read_timer( );
+
+    //
+    //  the parallel algorithms are timed as a whole from the calling thread
+    //
+    initPhaseTimers( 1 );
+    char *tracename = read_string( argc, argv, "-trace", NULL );
+    if( tracename && !startTrace( read_int( argc, argv, "-tracecapacity", 65536 ) ) )
+        tracename = NULL;
+    if( find_option( argc, argv, "-counters" ) >= 0 )
+        startCounters( );
+    for( int step = firstStep; step < NSTEPS; step++ )
+    {
+        //
+        //  bin particles: key every particle by its cell and sort indices by key
+        //
+        startPhase( 0, PHASE_BIN );
+        std::transform(std::execution::par_unseq, particles, particles + n, cellOf, [](const particle_t &p){
+            int x = min(static_cast<int>(std::floor(p.x / interval)), cellsteps - 1);
+            int y = min(static_cast<int>(std::floor(p.y / interval)), cellsteps - 1);
+            return x * cellsteps + y;
+        });
+        std::iota(order, order + n, 0);
+        std::sort(std::execution::par_unseq, order, order + n, [](int a, int b){
+            return cellOf[a] < cellOf[b] || (cellOf[a] == cellOf[b] && a < b);
+        });
+        std::transform(std::execution::par_unseq, order, order + n, sortedCells, [](int i){
+            return cellOf[i];
+        });
+        std::transform(std::execution::par_unseq, cellIds, cellIds + cells + 1, cellStart, [n](int c){
+            return static_cast<int>(std::lower_bound(sortedCells, sortedCells + n, c) - sortedCells);
+        });
+
+        //
+        //  collect the density field of save steps from the sorted bins
+        //
+        if( density && (step%SAVEFREQ) == 0 )
+        {
+            for( int k = 0; k < n; k++ )
+                addToDensity( density, sortedCells[k] / cellsteps, sortedCells[k] % cellsteps, particles[order[k]] );
+            writeDensity( density, step );
+        }
+
+        //
+        //  compute forces, walking particles in cell order for locality
+        //
+        startPhase( 0, PHASE_FORCE );
+        std::for_each(std::execution::par_unseq, order, order + n, [particles](int i){
+            applyForcesSorted(particles, i);
+        });
+        COUNT_PAIRS(pairsSorted(n));
+
+        //
+        //  move particles
+        //
+        startPhase( 0, PHASE_MOVE );
+        std::for_each(std::execution::par_unseq, particles, particles + n, [](particle_t &p){
+            move(p);
+        });
+
+        //
+        //  save if necessary
+        //
+        startPhase( 0, PHASE_SAVE );
+        if( selection && (step%SAVEFREQ) == 0 )
+            selectFromCells( selection, cellStart, order, particles, n );
+        if( fsave && (step%SAVEFREQ) == 0 )
+            save( fsave, selection ? selection->count : n, selection ? selection->p : particles );
+        if( trajectory && (step%SAVEFREQ) == 0 )
+            writeParticles( trajectory, step, selection ? selection->count : n, selection ? selection->p : particles );
+        if( stream && (step%SAVEFREQ) == 0 )
+            publishFrame( stream, step, selection ? selection->count : n, selection ? selection->p : particles );
+
+        //
+        //  checkpoint the state the next step starts from
+        //
+        if( checkpoint && (step+1)%checkpointfreq == 0 )
+            saveCheckpoint( checkpoint, step+1, particles );
+    }
+    stopPhase( 0 );
+    simulation_time = read_timer( ) - simulation_time;
+
+    printf( "\nn = %d, simulation time = %g seconds\n", n, simulation_time );
+    printPhaseTimers( );
+    if( tracename )
+        writeTrace( tracename );
+
+    free(cellIds);
+    free(cellStart);
+    free(sortedCells);
+    free(order);
+    free(cellOf);
+    free( particles );
+    if( fsave )
+        fclose( fsave );
+    if( trajectory )
+        closeTrajectory( trajectory );
+    if( checkpoint )
+        stopCheckpoints( checkpoint );
+    if( density )
+        closeDensity( density );
+    if( stream )
+        closeStream( stream );
+    if( selection )
+        freeSelection( selection );
+    freePhaseTimers( );
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef __CS267_STREAM_H__
+#define __CS267_STREAM_H__
+
+#include "common.h"
+
+//
+//  live frames in POSIX shared memory: a header followed by a ring of
+//  slots, each holding the (x, y) positions of one frame as doubles; the
+//  simulation overwrites the oldest slot and never waits for readers,
+//  readers check the sequence number of a slot before and after using it
+//  and drop the frame if it was overwritten in between
+//
+const char STREAM_MAGIC[8] = { 'C', 'S', '2', '6', '7', 'S', 'H', 'M' };
+const int STREAM_VERSION = 1;
+
+typedef struct
+{
+    char magic[8];
+    int version;
+    int slots;
+    long long n;
+    long long slotBytes;
+    double size;
+    double dt;
+    int savefreq;
+    int closed;
+
+    //
+    //  number of frames published so far, frame f is in slot f % slots
+    //
+    unsigned long long published;
+} stream_header_t;
+
+//
+//  sequence is 2 f + 1 while frame f is written into the slot and 2 f + 2
+//  once it is complete; the positions follow the slot header
+//
+typedef struct
+{
+    unsigned long long sequence;
+    long long step;
+    long long count;
+    long long reserved;
+} stream_slot_t;
+
+typedef struct
+{
+    char *name;
+    char *base;
+    size_t length;
+    stream_header_t *header;
+    long long published;
+    double publishTime;
+} stream_t;
+
+stream_t *openStream( const char *name, int n, int slots );
+void publishFrame( stream_t *s, long long step, int count, particle_t *p );
+void closeStream( stream_t *s );
+
+//
+//  reading: a view points into the shared memory and is only known to be
+//  intact if streamFrameValid still holds after it has been used
+//
+typedef struct
+{
+    char *base;
+    size_t length;
+    const stream_header_t *header;
+} stream_reader_t;
+
+typedef struct
+{
+    unsigned long long frame;
+    unsigned long long sequence;
+    long long step;
+    int count;
+    const double *xy;
+    const stream_slot_t *slot;
+} stream_frame_t;
+
+stream_reader_t *attachStream( const char *name );
+unsigned long long publishedFrames( const stream_reader_t *r );
+bool streamClosed( const stream_reader_t *r );
+bool viewStreamFrame( const stream_reader_t *r, unsigned long long frame, stream_frame_t *view );
+bool streamFrameValid( const stream_frame_t *view );
+bool copyStreamFrame( const stream_reader_t *r, unsigned long long frame, stream_frame_t *view, double *xy );
+void detachStream( stream_reader_t *r );
+
+#endif
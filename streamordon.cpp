@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stream.h"
+
+//
+//  shared memory object names start with a slash
+//
+static char *streamName( const char *name )
+{
+    char *shmName = (char*) malloc( strlen( name ) + 2 );
+    sprintf( shmName, "%s%s", name[0] == '/' ? "" : "/", name );
+    return shmName;
+}
+
+static stream_slot_t *streamSlot( char *base, const stream_header_t *header, unsigned long long frame )
+{
+    return (stream_slot_t*)( base + sizeof(stream_header_t) + ( frame % header->slots ) * header->slotBytes );
+}
+
+//
+//  a new segment for frames of up to n particles; one left behind by a run
+//  that did not finish is replaced, readers still attached to it keep the
+//  old one
+//
+stream_t *openStream( const char *name, int n, int slots )
+{
+    char *shmName = streamName( name );
+    shm_unlink( shmName );
+    int fd = shm_open( shmName, O_CREAT | O_RDWR, 0644 );
+    if( fd < 0 )
+    {
+        fprintf( stderr, "cannot create shared memory %s\n", shmName );
+        free( shmName );
+        return NULL;
+    }
+
+    slots = max( slots, 1 );
+    long long slotBytes = ( sizeof(stream_slot_t) + 2LL * max( n, 1 ) * sizeof(double) + 63 ) / 64 * 64;
+    size_t length = sizeof(stream_header_t) + slots * slotBytes;
+    void *p = ftruncate( fd, length ) == 0 ? mmap( NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) : MAP_FAILED;
+    close( fd );
+    if( p == MAP_FAILED )
+    {
+        fprintf( stderr, "cannot map shared memory %s\n", shmName );
+        shm_unlink( shmName );
+        free( shmName );
+        return NULL;
+    }
+
+    stream_t *s = (stream_t*) calloc( 1, sizeof(stream_t) );
+    s->name = shmName;
+    s->base = (char*) p;
+    s->length = length;
+    s->header = (stream_header_t*) p;
+    stream_header_t *h = s->header;
+    h->version = STREAM_VERSION;
+    h->slots = slots;
+    h->n = n;
+    h->slotBytes = slotBytes;
+    h->size = getSize( );
+    h->dt = getDt( );
+    h->savefreq = SAVEFREQ;
+
+    //
+    //  readers only look at a header with the magic in place
+    //
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    memcpy( h->magic, STREAM_MAGIC, sizeof(STREAM_MAGIC) );
+    return s;
+}
+
+//
+//  overwrite the oldest slot, readers of that frame see its sequence
+//  number change
+//
+void publishFrame( stream_t *s, long long step, int count, particle_t *p )
+{
+    double start = read_timer( );
+    unsigned long long frame = s->published;
+    stream_slot_t *slot = streamSlot( s->base, s->header, frame );
+    count = min( count, (int)s->header->n );
+
+    __atomic_store_n( &slot->sequence, 2 * frame + 1, __ATOMIC_RELAXED );
+    __atomic_thread_fence( __ATOMIC_RELEASE );
+    slot->step = step;
+    slot->count = count;
+    double *xy = (double*)( slot + 1 );
+    for( int i = 0; i < count; i++ )
+    {
+        xy[2*i] = p[i].x;
+        xy[2*i+1] = p[i].y;
+    }
+    __atomic_store_n( &slot->sequence, 2 * frame + 2, __ATOMIC_RELEASE );
+    __atomic_store_n( &s->header->published, frame + 1, __ATOMIC_RELEASE );
+
+    s->published++;
+    s->publishTime += read_timer( ) - start;
+}
+
+//
+//  readers that are still attached see the stream closed and keep their
+//  mapping, new ones can no longer attach
+//
+void closeStream( stream_t *s )
+{
+    __atomic_store_n( &s->header->closed, 1, __ATOMIC_RELEASE );
+    printf( "stream: %lld frames published to %s through %d slots in %g s\n", s->published, s->name, s->header->slots, s->publishTime );
+    munmap( s->base, s->length );
+    shm_unlink( s->name );
+    free( s->name );
+    free( s );
+}
+
+stream_reader_t *attachStream( const char *name )
+{
+    char *shmName = streamName( name );
+    int fd = shm_open( shmName, O_RDONLY, 0 );
+    free( shmName );
+    if( fd < 0 )
+        return NULL;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if( fstat( fd, &st ) == 0 && (size_t)st.st_size >= sizeof(stream_header_t) )
+        p = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( p == MAP_FAILED )
+        return NULL;
+
+    const stream_header_t *h = (const stream_header_t*) p;
+    bool valid = memcmp( h->magic, STREAM_MAGIC, sizeof(STREAM_MAGIC) ) == 0;
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    if( !valid || h->version != STREAM_VERSION || sizeof(stream_header_t) + h->slots * h->slotBytes > (size_t)st.st_size )
+    {
+        munmap( p, st.st_size );
+        return NULL;
+    }
+
+    stream_reader_t *r = (stream_reader_t*) calloc( 1, sizeof(stream_reader_t) );
+    r->base = (char*) p;
+    r->length = st.st_size;
+    r->header = h;
+    return r;
+}
+
+unsigned long long publishedFrames( const stream_reader_t *r )
+{
+    return __atomic_load_n( &r->header->published, __ATOMIC_ACQUIRE );
+}
+
+bool streamClosed( const stream_reader_t *r )
+{
+    return __atomic_load_n( &r->header->closed, __ATOMIC_ACQUIRE ) != 0;
+}
+
+//
+//  point the view at a frame that is complete and still in the ring
+//
+bool viewStreamFrame( const stream_reader_t *r, unsigned long long frame, stream_frame_t *view )
+{
+    if( frame >= publishedFrames( r ) )
+        return false;
+    const stream_slot_t *slot = streamSlot( r->base, r->header, frame );
+    unsigned long long sequence = __atomic_load_n( &slot->sequence, __ATOMIC_ACQUIRE );
+    if( sequence != 2 * frame + 2 )
+        return false;
+    view->frame = frame;
+    view->sequence = sequence;
+    view->slot = slot;
+    view->step = slot->step;
+    long long count = slot->count;
+    view->count = (int)( count < 0 ? 0 : count > r->header->n ? r->header->n : count );
+    view->xy = (const double*)( slot + 1 );
+    return true;
+}
+
+//
+//  whether the frame was left alone while the view was in use
+//
+bool streamFrameValid( const stream_frame_t *view )
+{
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    return __atomic_load_n( &view->slot->sequence, __ATOMIC_RELAXED ) == view->sequence;
+}
+
+//
+//  copy of a frame, xy holds 2 n values
+//
+bool copyStreamFrame( const stream_reader_t *r, unsigned long long frame, stream_frame_t *view, double *xy )
+{
+    if( !viewStreamFrame( r, frame, view ) )
+        return false;
+    memcpy( xy, view->xy, (size_t)view->count * 2 * sizeof(double) );
+    if( !streamFrameValid( view ) )
+        return false;
+    view->xy = xy;
+    return true;
+}
+
+void detachStream( stream_reader_t *r )
+{
+    munmap( r->base, r->length );
+    free( r );
+}
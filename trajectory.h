@@ -0,0 +1,156 @@
+#ifndef __CS267_TRAJECTORY_H__
+#define __CS267_TRAJECTORY_H__
+
+#include <stdio.h>
+#include <pthread.h>
+#include "common.h"
+#include "direct.h"
+
+//
+//  binary trajectory file: a fixed header, the frames, and a table with the
+//  step and file offset of every frame at the end; all values are in the
+//  byte order of the writer
+//
+//  frames are either raw (x, y) pairs of floats or doubles, or positions
+//  quantized to bits bits across [0, size] and stored as zigzag varints of
+//  the difference to the previous frame (to 0 in every keyframes-th frame),
+//  which decode to within size / (2^(bits+1) - 2) of the true positions
+//
+//  raw frames of a counted trajectory hold a varying number of particles
+//  (at most n) and start with that number as a long long
+//
+const char TRAJECTORY_MAGIC[8] = { 'C', 'S', '2', '6', '7', 'T', 'R', 'J' };
+const int TRAJECTORY_VERSION = 3;
+
+enum { TRAJECTORY_RAW, TRAJECTORY_DELTA };
+
+typedef struct
+{
+    char magic[8];
+    int version;
+    int precision;
+    long long n;
+    double size;
+    double dt;
+    int savefreq;
+    int frames;
+    long long indexOffset;
+
+    //
+    //  version 2
+    //
+    int encoding;
+    int bits;
+    int keyframes;
+
+    //
+    //  version 3, 0 in older files
+    //
+    int counted;
+} trajectory_header_t;
+
+typedef struct
+{
+    long long step;
+    long long offset;
+    long long bytes;
+} trajectory_frame_t;
+
+//
+//  frame waiting in the queue of the writer thread, raw positions or
+//  quantized ones
+//
+typedef struct
+{
+    char *data;
+    size_t bytes;
+    long long step;
+} trajectory_slot_t;
+
+//
+//  header and frame index of a trajectory being written; f is NULL when the
+//  frames are written by someone else (MPI-IO) and only the layout is kept
+//  here, or when they go through direct
+//
+typedef struct
+{
+    FILE *f;
+    direct_file_t *direct;
+    trajectory_header_t header;
+    trajectory_frame_t *index;
+    int capacity;
+    long long end;
+    char *buffer;
+    size_t bufferSize;
+
+    //
+    //  previous quantized frame of a delta encoded trajectory
+    //
+    unsigned int *previous;
+
+    //
+    //  with depth > 0 frames are copied into a ring of depth slots and
+    //  encoded and written by a background thread; the simulation only waits
+    //  (stalls) when all slots are still queued
+    //
+    int depth;
+    trajectory_slot_t *slots;
+    int head, queued;
+    bool stop;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty, notFull;
+    int stalls;
+    int maxQueued;
+    double stallTime;
+    double encodeTime;
+} trajectory_t;
+
+//
+//  writing
+//
+trajectory_t *newTrajectory( int n, int precision );
+size_t packFrame( trajectory_t *t, int count, particle_t *p );
+void indexFrame( trajectory_t *t, long long step, long long bytes );
+void freeTrajectory( trajectory_t *t );
+
+trajectory_t *openTrajectory( const char *filename, int n, int precision, int depth );
+void compressTrajectory( trajectory_t *t, int bits );
+void countTrajectory( trajectory_t *t );
+void directTrajectory( trajectory_t *t, const char *filename, int depth );
+void writeFrame( trajectory_t *t, int step, particle_t *p );
+void writeParticles( trajectory_t *t, int step, int count, particle_t *p );
+void closeTrajectory( trajectory_t *t );
+
+//
+//  reading: delta frames are decoded from the closest keyframe unless the
+//  previous frame was the last one read; the index of a file whose writer
+//  did not finish is rebuilt from the frames; count is the number of
+//  particles in the frame read last
+//
+typedef struct
+{
+    FILE *f;
+    trajectory_header_t header;
+    trajectory_frame_t *index;
+    int count;
+    unsigned int *quantized;
+    int decoded;
+    unsigned char *buffer;
+    size_t bufferSize;
+} trajectory_reader_t;
+
+trajectory_reader_t *openTrajectoryReader( const char *filename );
+bool readFrame( trajectory_reader_t *r, int frame, double *xy );
+void closeTrajectoryReader( trajectory_reader_t *r );
+
+//
+//  shared by the readers
+//
+size_t parseTrajectoryHeader( const char *bytes, size_t length, trajectory_header_t *header );
+bool decodeDeltaFrame( const unsigned char *in, long long bytes, long long values, bool key, unsigned int *q );
+double quantizationScale( const trajectory_header_t *header );
+double trajectoryError( const trajectory_header_t *header );
+long long countedFrameBytes( const trajectory_header_t *header, const char *frame, long long available );
+
+#endif
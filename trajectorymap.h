@@ -0,0 +1,64 @@
+#ifndef __CS267_TRAJECTORYMAP_H__
+#define __CS267_TRAJECTORYMAP_H__
+
+#include "trajectory.h"
+
+//
+//  a whole trajectory mapped into memory for viewers and other tools:
+//  frames of binary trajectories are read straight from the mapping, delta
+//  encoded frames are decoded into the view, and legacy text files are
+//  parsed once into floats (which hold the six digits of %g exactly) by
+//  several threads
+//
+enum { MAP_BINARY, MAP_TEXT };
+
+typedef struct
+{
+    int format;
+    int n;
+    double size;
+    int frames;
+    trajectory_header_t header;
+    trajectory_frame_t *index;
+
+    char *base;
+    size_t length;
+    float *text;
+} trajectory_map_t;
+
+//
+//  positions of one frame: 2 n floats or doubles, x and y interleaved (n
+//  varies from frame to frame in counted trajectories); a
+//  view also keeps the state to decode delta frames, so every thread
+//  reading frames needs its own
+//
+typedef struct
+{
+    int n;
+    int precision;
+    long long step;
+    const void *xy;
+
+    unsigned int *quantized;
+    double *decoded;
+    int decodedFrame;
+} frame_view_t;
+
+trajectory_map_t *mapTrajectory( const char *filename, int threads );
+void unmapTrajectory( trajectory_map_t *m );
+
+void initFrameView( frame_view_t *view );
+bool viewFrame( const trajectory_map_t *m, int frame, frame_view_t *view );
+void freeFrameView( frame_view_t *view );
+
+inline double viewX( const frame_view_t *view, int i )
+{
+    return view->precision == sizeof(float) ? ((const float*) view->xy)[2*i] : ((const double*) view->xy)[2*i];
+}
+
+inline double viewY( const frame_view_t *view, int i )
+{
+    return view->precision == sizeof(float) ? ((const float*) view->xy)[2*i+1] : ((const double*) view->xy)[2*i+1];
+}
+
+#endif
@@ -0,0 +1,356 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <charconv>
+#include "trajectorymap.h"
+
+static bool mapFile( const char *filename, char **base, size_t *length )
+{
+    int fd = open( filename, O_RDONLY );
+    if( fd < 0 )
+        return false;
+    struct stat st;
+    if( fstat( fd, &st ) != 0 )
+    {
+        close( fd );
+        return false;
+    }
+    *length = st.st_size;
+    *base = NULL;
+    if( *length > 0 )
+    {
+        void *p = mmap( NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( p == MAP_FAILED )
+        {
+            close( fd );
+            return false;
+        }
+        *base = (char*) p;
+    }
+    close( fd );
+    return true;
+}
+
+//
+//  frame index of a binary trajectory: the table at the end, or, if the
+//  writer did not finish, rebuilt from the frames between the header and
+//  the end of the file
+//
+static void loadIndex( trajectory_map_t *m, long long start )
+{
+    const trajectory_header_t &h = m->header;
+    long long table = (long long)h.frames * sizeof(trajectory_frame_t);
+    if( h.indexOffset > 0 && h.indexOffset + table <= (long long)m->length )
+    {
+        m->frames = h.frames;
+        m->index = (trajectory_frame_t*) malloc( max( m->frames, 1 ) * sizeof(trajectory_frame_t) );
+        memcpy( m->index, m->base + h.indexOffset, table );
+        return;
+    }
+
+    long long end = m->length;
+    if( h.indexOffset > 0 && h.indexOffset < end )
+        end = h.indexOffset;
+    long long values = 2 * h.n;
+    int capacity = 16;
+    m->frames = 0;
+    m->index = (trajectory_frame_t*) malloc( capacity * sizeof(trajectory_frame_t) );
+    for( long long offset = start; values > 0 && offset < end; )
+    {
+        long long bytes = values * h.precision;
+        if( h.encoding == TRAJECTORY_DELTA )
+        {
+            long long terminators = 0;
+            for( bytes = 0; terminators < values && offset + bytes < end; bytes++ )
+                if( !( m->base[offset + bytes] & 0x80 ) )
+                    terminators++;
+            if( terminators < values )
+                break;
+        }else if( h.counted ) {
+            bytes = countedFrameBytes( &h, m->base + offset, end - offset );
+            if( bytes == 0 || offset + bytes > end )
+                break;
+        }else if( offset + bytes > end ) {
+            break;
+        }
+
+        if( m->frames == capacity )
+        {
+            capacity *= 2;
+            m->index = (trajectory_frame_t*) realloc( m->index, capacity * sizeof(trajectory_frame_t) );
+        }
+        m->index[m->frames].step = (long long)m->frames * h.savefreq;
+        m->index[m->frames].offset = offset;
+        m->index[m->frames].bytes = bytes;
+        m->frames++;
+        offset += bytes;
+    }
+}
+
+//
+//  a chunk of whole lines of a text trajectory, counted in the first pass
+//  and parsed in the second
+//
+typedef struct
+{
+    const char *begin;
+    const char *end;
+    long long lines;
+    long long first;
+    long long keep;
+    float *xy;
+    int pass;
+} text_chunk_t;
+
+static const char *parseFloat( const char *p, const char *end, float *value )
+{
+    while( p < end && ( *p == ' ' || *p == '\t' ) )
+        p++;
+    std::from_chars_result result = std::from_chars( p, end, *value );
+    if( result.ec != std::errc() )
+        *value = 0;
+    return result.ptr;
+}
+
+static void *textChunk( void *arg )
+{
+    text_chunk_t *c = (text_chunk_t*) arg;
+    const char *p = c->begin;
+    if( c->pass == 0 )
+    {
+        c->lines = 0;
+        while( p < c->end && ( p = (const char*) memchr( p, '\n', c->end - p ) ) )
+        {
+            c->lines++;
+            p++;
+        }
+        if( c->end > c->begin && c->end[-1] != '\n' )
+            c->lines++;
+        return NULL;
+    }
+
+    for( long long line = c->first; line < c->keep && p < c->end; line++ )
+    {
+        const char *eol = (const char*) memchr( p, '\n', c->end - p );
+        if( !eol )
+            eol = c->end;
+        const char *q = parseFloat( p, eol, &c->xy[2*line] );
+        parseFloat( q, eol, &c->xy[2*line+1] );
+        p = eol + 1;
+    }
+    return NULL;
+}
+
+static void runChunks( text_chunk_t *chunks, int threads, int pass )
+{
+    pthread_t *workers = (pthread_t*) malloc( threads * sizeof(pthread_t) );
+    for( int t = 0; t < threads; t++ )
+    {
+        chunks[t].pass = pass;
+        if( t > 0 )
+            pthread_create( &workers[t], NULL, textChunk, &chunks[t] );
+    }
+    textChunk( &chunks[0] );
+    for( int t = 1; t < threads; t++ )
+        pthread_join( workers[t], NULL );
+    free( workers );
+}
+
+//
+//  legacy text trajectory: a line "n size", then one "x y" line per particle
+//  and frame; the lines are split into one chunk per thread, counted, and
+//  parsed into their place in the second pass
+//
+static bool parseText( trajectory_map_t *m, int threads )
+{
+    const char *begin = m->base, *end = m->base + m->length;
+    const char *body = (const char*) memchr( begin, '\n', end - begin );
+    if( !body )
+        return false;
+    body++;
+    const char *p = begin;
+    while( p < body && *p == ' ' )
+        p++;
+    std::from_chars_result result = std::from_chars( p, body, m->n );
+    if( result.ec != std::errc() || m->n <= 0 )
+        return false;
+    p = result.ptr;
+    while( p < body && *p == ' ' )
+        p++;
+    if( std::from_chars( p, body, m->size ).ec != std::errc() )
+        return false;
+
+    text_chunk_t *chunks = (text_chunk_t*) calloc( threads, sizeof(text_chunk_t) );
+    for( int t = 0; t < threads; t++ )
+    {
+        const char *from = body + ( end - body ) * t / threads;
+        if( t > 0 )
+        {
+            from = (const char*) memchr( from - 1, '\n', end - ( from - 1 ) );
+            from = from ? from + 1 : end;
+            if( from < chunks[t-1].begin )
+                from = chunks[t-1].begin;
+        }
+        chunks[t].begin = from;
+        if( t > 0 )
+            chunks[t-1].end = from;
+    }
+    chunks[threads-1].end = end;
+
+    runChunks( chunks, threads, 0 );
+    long long lines = 0;
+    for( int t = 0; t < threads; t++ )
+    {
+        chunks[t].first = lines;
+        lines += chunks[t].lines;
+    }
+    m->frames = (int)( lines / m->n );
+    long long keep = (long long)m->frames * m->n;
+    m->text = (float*) malloc( ( keep > 0 ? keep : 1 ) * 2 * sizeof(float) );
+    for( int t = 0; t < threads; t++ )
+    {
+        chunks[t].keep = keep;
+        chunks[t].xy = m->text;
+    }
+    runChunks( chunks, threads, 1 );
+    free( chunks );
+    return true;
+}
+
+//
+//  map a binary trajectory or parse a text one with that many threads (all
+//  processors if threads <= 0)
+//
+trajectory_map_t *mapTrajectory( const char *filename, int threads )
+{
+    trajectory_map_t *m = (trajectory_map_t*) calloc( 1, sizeof(trajectory_map_t) );
+    if( !mapFile( filename, &m->base, &m->length ) )
+    {
+        fprintf( stderr, "cannot map %s\n", filename );
+        free( m );
+        return NULL;
+    }
+
+    size_t start = parseTrajectoryHeader( m->base, m->length, &m->header );
+    if( start > 0 )
+    {
+        m->format = MAP_BINARY;
+        m->n = (int)m->header.n;
+        m->size = m->header.size;
+        loadIndex( m, start );
+        return m;
+    }
+
+    if( threads <= 0 )
+        threads = (int)sysconf( _SC_NPROCESSORS_ONLN );
+    m->format = MAP_TEXT;
+    bool parsed = parseText( m, max( threads, 1 ) );
+    if( m->base )
+        munmap( m->base, m->length );
+    m->base = NULL;
+    m->length = 0;
+    if( !parsed )
+    {
+        fprintf( stderr, "%s is neither a trajectory nor a text output file\n", filename );
+        unmapTrajectory( m );
+        return NULL;
+    }
+    return m;
+}
+
+void unmapTrajectory( trajectory_map_t *m )
+{
+    if( m->base )
+        munmap( m->base, m->length );
+    free( m->index );
+    free( m->text );
+    free( m );
+}
+
+void initFrameView( frame_view_t *view )
+{
+    memset( view, 0, sizeof(frame_view_t) );
+    view->decodedFrame = -1;
+}
+
+void freeFrameView( frame_view_t *view )
+{
+    free( view->quantized );
+    free( view->decoded );
+    initFrameView( view );
+}
+
+//
+//  point the view at a frame; raw and text frames are not copied, delta
+//  frames are decoded from the closest keyframe or the frame the view held
+//  before
+//
+bool viewFrame( const trajectory_map_t *m, int frame, frame_view_t *view )
+{
+    if( frame < 0 || frame >= m->frames )
+        return false;
+    view->n = m->n;
+    long long values = 2LL * m->n;
+
+    if( m->format == MAP_TEXT )
+    {
+        view->precision = sizeof(float);
+        view->step = (long long)frame * SAVEFREQ;
+        view->xy = m->text + frame * values;
+        return true;
+    }
+
+    const trajectory_header_t &h = m->header;
+    const trajectory_frame_t &entry = m->index[frame];
+    if( entry.offset + entry.bytes > (long long)m->length )
+        return false;
+    view->step = entry.step;
+    if( h.encoding == TRAJECTORY_RAW && h.counted )
+    {
+        long long bytes = countedFrameBytes( &h, m->base + entry.offset, entry.bytes );
+        if( bytes == 0 || bytes > entry.bytes )
+            return false;
+        view->n = (int)( ( bytes - sizeof(long long) ) / ( 2 * h.precision ) );
+        view->precision = h.precision;
+        view->xy = m->base + entry.offset + sizeof(long long);
+        return true;
+    }
+    if( h.encoding == TRAJECTORY_RAW )
+    {
+        if( entry.bytes < values * h.precision )
+            return false;
+        view->precision = h.precision;
+        view->xy = m->base + entry.offset;
+        return true;
+    }
+
+    if( !view->quantized )
+    {
+        view->quantized = (unsigned int*) malloc( ( values > 0 ? values : 1 ) * sizeof(unsigned int) );
+        view->decoded = (double*) malloc( ( values > 0 ? values : 1 ) * sizeof(double) );
+    }
+    int first = frame - frame % h.keyframes;
+    if( view->decodedFrame >= first && view->decodedFrame <= frame )
+        first = view->decodedFrame + 1;
+    for( int k = first; k <= frame; k++ )
+    {
+        const trajectory_frame_t &e = m->index[k];
+        if( !decodeDeltaFrame( (const unsigned char*) m->base + e.offset, e.bytes, values, k % h.keyframes == 0, view->quantized ) )
+        {
+            view->decodedFrame = -1;
+            return false;
+        }
+        view->decodedFrame = k;
+    }
+    double scale = quantizationScale( &h );
+    for( long long i = 0; i < values; i++ )
+        view->decoded[i] = view->quantized[i] / scale;
+    view->precision = sizeof(double);
+    view->xy = view->decoded;
+    return true;
+}
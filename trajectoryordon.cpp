@@ -0,0 +1,654 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <float.h>
+#include <sys/types.h>
+#include "trajectory.h"
+
+//
+//  a delta encoded trajectory restarts from zero every that many frames, so
+//  a reader never decodes more than that to reach a frame
+//
+static const int KEYFRAMES = 20;
+
+//
+//  layout of a trajectory with n particles, frames are appended after the
+//  header
+//
+trajectory_t *newTrajectory( int n, int precision )
+{
+    trajectory_t *t = (trajectory_t*) calloc( 1, sizeof(trajectory_t) );
+    memcpy( t->header.magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC) );
+    t->header.version = TRAJECTORY_VERSION;
+    t->header.precision = precision == sizeof(float) ? sizeof(float) : sizeof(double);
+    t->header.n = n;
+    t->header.size = getSize();
+    t->header.dt = getDt();
+    t->header.savefreq = SAVEFREQ;
+    t->header.encoding = TRAJECTORY_RAW;
+    t->header.keyframes = 1;
+    t->end = sizeof(trajectory_header_t);
+    return t;
+}
+
+//
+//  positions of count particles in the given precision
+//
+static size_t packPositions( char *buffer, int precision, int count, particle_t *p )
+{
+    if( precision == sizeof(float) )
+    {
+        float *xy = (float*) buffer;
+        for( int i = 0; i < count; i++ )
+        {
+            xy[2*i] = (float) p[i].x;
+            xy[2*i+1] = (float) p[i].y;
+        }
+    }else {
+        double *xy = (double*) buffer;
+        for( int i = 0; i < count; i++ )
+        {
+            xy[2*i] = p[i].x;
+            xy[2*i+1] = p[i].y;
+        }
+    }
+    return (size_t)count * 2 * precision;
+}
+
+//
+//  positions of count particles in the precision of the file, into the
+//  buffer of the trajectory
+//
+size_t packFrame( trajectory_t *t, int count, particle_t *p )
+{
+    size_t bytes = (size_t)count * 2 * t->header.precision;
+    if( bytes > t->bufferSize )
+    {
+        t->bufferSize = bytes;
+        t->buffer = (char*) realloc( t->buffer, bytes );
+    }
+    return packPositions( t->buffer, t->header.precision, count, p );
+}
+
+//
+//  fixed point positions: [0, size] maps onto [0, 2^bits - 1], rounding to
+//  the nearest step
+//
+double quantizationScale( const trajectory_header_t *header )
+{
+    return (double)( ( 1u << header->bits ) - 1 ) / header->size;
+}
+
+static size_t quantizePositions( const trajectory_header_t *header, unsigned int *q, int count, particle_t *p )
+{
+    double scale = quantizationScale( header );
+    double top = (double)( ( 1u << header->bits ) - 1 );
+    for( int i = 0; i < count; i++ )
+    {
+        double x = p[i].x * scale + 0.5, y = p[i].y * scale + 0.5;
+        q[2*i] = (unsigned int)( x < 0 ? 0 : x > top ? top : x );
+        q[2*i+1] = (unsigned int)( y < 0 ? 0 : y > top ? top : y );
+    }
+    return (size_t)count * 2 * sizeof(unsigned int);
+}
+
+//
+//  zigzag varints of the differences to the previous frame, at most five
+//  bytes per coordinate
+//
+static size_t encodeFrame( trajectory_t *t, const unsigned int *q, bool key )
+{
+    long long values = 2 * t->header.n;
+    if( (size_t)values * 5 > t->bufferSize )
+    {
+        t->bufferSize = values * 5;
+        t->buffer = (char*) realloc( t->buffer, t->bufferSize );
+    }
+
+    unsigned char *out = (unsigned char*) t->buffer;
+    for( long long i = 0; i < values; i++ )
+    {
+        long long d = (long long)q[i] - ( key ? 0 : (long long)t->previous[i] );
+        unsigned long long z = ( (unsigned long long)d << 1 ) ^ (unsigned long long)( d >> 63 );
+        while( z >= 0x80 )
+        {
+            *out++ = (unsigned char)( z | 0x80 );
+            z >>= 7;
+        }
+        *out++ = (unsigned char)z;
+    }
+    memcpy( t->previous, q, values * sizeof(unsigned int) );
+    return out - (unsigned char*) t->buffer;
+}
+
+//
+//  record a frame of the given size at the end of the file
+//
+void indexFrame( trajectory_t *t, long long step, long long bytes )
+{
+    if( t->header.frames == t->capacity )
+    {
+        t->capacity = max( 16, 2 * t->capacity );
+        t->index = (trajectory_frame_t*) realloc( t->index, t->capacity * sizeof(trajectory_frame_t) );
+    }
+    trajectory_frame_t &frame = t->index[t->header.frames++];
+    frame.step = step;
+    frame.offset = t->end;
+    frame.bytes = bytes;
+    t->end += bytes;
+}
+
+void freeTrajectory( trajectory_t *t )
+{
+    free( t->index );
+    free( t->buffer );
+    free( t->previous );
+    free( t );
+}
+
+//
+//  copy a frame into a slot, quantized if it is going to be delta encoded,
+//  after its particle count if the trajectory is counted
+//
+static void fillSlot( trajectory_t *t, trajectory_slot_t *slot, int step, int count, particle_t *p )
+{
+    slot->step = step;
+    if( t->header.encoding == TRAJECTORY_DELTA )
+    {
+        slot->bytes = quantizePositions( &t->header, (unsigned int*) slot->data, count, p );
+    }else if( t->header.counted ) {
+        long long particles = count;
+        memcpy( slot->data, &particles, sizeof(long long) );
+        slot->bytes = sizeof(long long) + packPositions( slot->data + sizeof(long long), t->header.precision, count, p );
+    }else {
+        slot->bytes = packPositions( slot->data, t->header.precision, count, p );
+    }
+}
+
+//
+//  encode and write the frame in a slot
+//
+static void emitFrame( trajectory_t *t, trajectory_slot_t *slot )
+{
+    const char *data = slot->data;
+    size_t bytes = slot->bytes;
+    if( t->header.encoding == TRAJECTORY_DELTA )
+    {
+        double encode = read_timer( );
+        bytes = encodeFrame( t, (unsigned int*) slot->data, t->header.frames % t->header.keyframes == 0 );
+        data = t->buffer;
+        t->encodeTime += read_timer( ) - encode;
+    }
+    indexFrame( t, slot->step, bytes );
+    if( t->direct )
+        appendDirect( t->direct, data, bytes );
+    else
+        fwrite( data, 1, bytes, t->f );
+}
+
+//
+//  background writer: takes frames from the head of the queue until it is
+//  empty and closing
+//
+static void *writerThread( void *arg )
+{
+    trajectory_t *t = (trajectory_t*) arg;
+    pthread_mutex_lock( &t->lock );
+    while( true )
+    {
+        while( t->queued == 0 && !t->stop )
+            pthread_cond_wait( &t->notEmpty, &t->lock );
+        if( t->queued == 0 )
+            break;
+        trajectory_slot_t *slot = &t->slots[t->head];
+        pthread_mutex_unlock( &t->lock );
+
+        emitFrame( t, slot );
+
+        pthread_mutex_lock( &t->lock );
+        t->head = ( t->head + 1 ) % t->depth;
+        t->queued--;
+        pthread_cond_signal( &t->notFull );
+    }
+    pthread_mutex_unlock( &t->lock );
+    return NULL;
+}
+
+//
+//  trajectory written with stdio, the header is rewritten with the
+//  location of the index once all frames are there; with depth > 0 the
+//  frames are written by a background thread
+//
+trajectory_t *openTrajectory( const char *filename, int n, int precision, int depth )
+{
+    FILE *f = fopen( filename, "wb" );
+    if( !f )
+        return NULL;
+    trajectory_t *t = newTrajectory( n, precision );
+    t->f = f;
+    fwrite( &t->header, sizeof(trajectory_header_t), 1, f );
+
+    t->depth = max( depth, 0 );
+    int slots = max( t->depth, 1 );
+    t->slots = (trajectory_slot_t*) malloc( slots * sizeof(trajectory_slot_t) );
+    for( int i = 0; i < slots; i++ )
+        t->slots[i].data = (char*) malloc( sizeof(long long) + (size_t)max( n, 1 ) * 2 * t->header.precision );
+    if( t->depth > 0 )
+    {
+        pthread_mutex_init( &t->lock, NULL );
+        pthread_cond_init( &t->notEmpty, NULL );
+        pthread_cond_init( &t->notFull, NULL );
+        pthread_create( &t->writer, NULL, writerThread, t );
+    }
+    return t;
+}
+
+//
+//  delta encode the frames at a resolution of bits bits, before the first
+//  frame is written
+//
+void compressTrajectory( trajectory_t *t, int bits )
+{
+    if( t->header.counted )
+    {
+        fprintf( stderr, "frames of varying size are not delta encoded\n" );
+        return;
+    }
+    t->header.encoding = TRAJECTORY_DELTA;
+    t->header.bits = min( max( bits, 1 ), 31 );
+    t->header.keyframes = KEYFRAMES;
+    t->previous = (unsigned int*) calloc( max( (int)t->header.n, 1 ) * 2, sizeof(unsigned int) );
+}
+
+//
+//  frames of up to n particles, before the first frame is written and
+//  before compressTrajectory, which then leaves the frames raw
+//
+void countTrajectory( trajectory_t *t )
+{
+    t->header.counted = 1;
+}
+
+//
+//  write the file again from the start with O_DIRECT and up to depth
+//  writes in flight, before the first frame is written; the header is
+//  rewritten once the frames and the index are on disk as with stdio
+//
+void directTrajectory( trajectory_t *t, const char *filename, int depth )
+{
+    fclose( t->f );
+    t->f = NULL;
+    t->direct = openDirect( filename, depth );
+    if( !t->direct )
+    {
+        fprintf( stderr, "cannot open %s for direct I/O, writing with stdio\n", filename );
+        t->f = fopen( filename, "wb" );
+        fwrite( &t->header, sizeof(trajectory_header_t), 1, t->f );
+        return;
+    }
+    appendDirect( t->direct, &t->header, sizeof(trajectory_header_t) );
+}
+
+void writeFrame( trajectory_t *t, int step, particle_t *p )
+{
+    writeParticles( t, step, (int)t->header.n, p );
+}
+
+//
+//  a frame of count particles, which has to be n unless the trajectory is
+//  counted
+//
+void writeParticles( trajectory_t *t, int step, int count, particle_t *p )
+{
+    if( t->depth == 0 )
+    {
+        fillSlot( t, &t->slots[0], step, count, p );
+        emitFrame( t, &t->slots[0] );
+        return;
+    }
+
+    //
+    //  wait for a free slot, fill it without holding the lock (the writer
+    //  only reads queued slots) and queue it
+    //
+    pthread_mutex_lock( &t->lock );
+    if( t->queued == t->depth )
+    {
+        double stall = read_timer( );
+        t->stalls++;
+        while( t->queued == t->depth )
+            pthread_cond_wait( &t->notFull, &t->lock );
+        t->stallTime += read_timer( ) - stall;
+    }
+    trajectory_slot_t *slot = &t->slots[( t->head + t->queued ) % t->depth];
+    pthread_mutex_unlock( &t->lock );
+
+    fillSlot( t, slot, step, count, p );
+
+    pthread_mutex_lock( &t->lock );
+    t->queued++;
+    t->maxQueued = max( t->maxQueued, t->queued );
+    pthread_cond_signal( &t->notEmpty );
+    pthread_mutex_unlock( &t->lock );
+}
+
+void closeTrajectory( trajectory_t *t )
+{
+    if( t->depth > 0 )
+    {
+        pthread_mutex_lock( &t->lock );
+        t->stop = true;
+        pthread_cond_signal( &t->notEmpty );
+        pthread_mutex_unlock( &t->lock );
+        pthread_join( t->writer, NULL );
+
+        printf( "trajectory writer: %d frames through %d slots, %d stalls waiting %g s, at most %d queued\n",
+                t->header.frames, t->depth, t->stalls, t->stallTime, t->maxQueued );
+        pthread_cond_destroy( &t->notFull );
+        pthread_cond_destroy( &t->notEmpty );
+        pthread_mutex_destroy( &t->lock );
+    }
+    if( t->header.encoding == TRAJECTORY_DELTA && t->header.frames > 0 )
+    {
+        double raw = (double)t->header.frames * t->header.n * 2 * sizeof(double);
+        double encoded = (double)( t->end - sizeof(trajectory_header_t) );
+        printf( "trajectory compressed %g:1 at %d bits (positions within %g), %g s encoding, %g MB/s\n",
+                raw / encoded, t->header.bits, trajectoryError( &t->header ), t->encodeTime, raw / 1e6 / t->encodeTime );
+    }
+    for( int i = 0; i < max( t->depth, 1 ); i++ )
+        free( t->slots[i].data );
+    free( t->slots );
+
+    t->header.indexOffset = t->end;
+    if( t->direct )
+    {
+        direct_file_t *d = t->direct;
+        appendDirect( d, t->index, t->header.frames * sizeof(trajectory_frame_t) );
+        if( !finishDirect( d, &t->header, sizeof(trajectory_header_t), false ) )
+            fprintf( stderr, "trajectory is incomplete\n" );
+        printf( "trajectory writes: %d of up to %d KB (%s, %s), at most %d in flight, %g s waiting\n",
+                d->writes, DIRECT_BUFFER >> 10, d->direct ? "O_DIRECT" : "page cache",
+                d->uring ? "io_uring" : "pwrite", d->maxInflight, d->waitTime );
+        freeDirect( d );
+        freeTrajectory( t );
+        return;
+    }
+    fwrite( t->index, sizeof(trajectory_frame_t), t->header.frames, t->f );
+    fseeko( t->f, 0, SEEK_SET );
+    fwrite( &t->header, sizeof(trajectory_header_t), 1, t->f );
+    fclose( t->f );
+    freeTrajectory( t );
+}
+
+//
+//  largest difference between a stored position and the simulated one
+//
+double trajectoryError( const trajectory_header_t *header )
+{
+    if( header->encoding == TRAJECTORY_DELTA )
+        return 0.5 / quantizationScale( header );
+    return header->precision == sizeof(float) ? 0.5 * FLT_EPSILON * header->size : 0;
+}
+
+//
+//  length of a counted frame from its first available bytes, 0 if they do
+//  not hold a valid count
+//
+long long countedFrameBytes( const trajectory_header_t *header, const char *frame, long long available )
+{
+    long long count;
+    if( available < (long long)sizeof(long long) )
+        return 0;
+    memcpy( &count, frame, sizeof(long long) );
+    if( count < 0 || count > header->n )
+        return 0;
+    return sizeof(long long) + count * 2 * header->precision;
+}
+
+//
+//  rebuild the index of a trajectory without a complete frame table from
+//  the frames between start and end: raw frames all have the same size
+//  unless they are counted, delta frames end after 2 n varints
+//
+static int rebuildIndex( FILE *f, const trajectory_header_t *header, long long start, long long end, trajectory_frame_t **index )
+{
+    int frames = 0, capacity = 16;
+    *index = (trajectory_frame_t*) malloc( capacity * sizeof(trajectory_frame_t) );
+    long long values = 2 * header->n;
+    long long rawBytes = values * header->precision;
+    long long offset = start;
+    fseeko( f, start, SEEK_SET );
+    while( values > 0 && offset < end )
+    {
+        long long bytes = 0;
+        if( header->encoding == TRAJECTORY_DELTA )
+        {
+            long long terminators = 0;
+            int c;
+            while( terminators < values && offset + bytes < end && ( c = getc( f ) ) != EOF )
+            {
+                bytes++;
+                if( !( c & 0x80 ) )
+                    terminators++;
+            }
+            if( terminators < values )
+                break;
+        }else if( header->counted ) {
+            char count[sizeof(long long)];
+            bytes = countedFrameBytes( header, count, fread( count, 1, sizeof(count), f ) );
+            if( bytes == 0 || offset + bytes > end )
+                break;
+            fseeko( f, offset + bytes, SEEK_SET );
+        }else {
+            if( offset + rawBytes > end )
+                break;
+            bytes = rawBytes;
+        }
+
+        if( frames == capacity )
+        {
+            capacity *= 2;
+            *index = (trajectory_frame_t*) realloc( *index, capacity * sizeof(trajectory_frame_t) );
+        }
+        (*index)[frames].step = (long long)frames * header->savefreq;
+        (*index)[frames].offset = offset;
+        (*index)[frames].bytes = bytes;
+        frames++;
+        offset += bytes;
+    }
+    return frames;
+}
+
+//
+//  header at the start of a trajectory, returns its length in the file or 0
+//  if the bytes are not the header of a supported version; version 1 files
+//  have the shorter header of raw frames only, version 2 ones are never
+//  counted
+//
+size_t parseTrajectoryHeader( const char *bytes, size_t length, trajectory_header_t *header )
+{
+    size_t v1 = offsetof( trajectory_header_t, encoding );
+    memset( header, 0, sizeof(trajectory_header_t) );
+    if( length < v1 || memcmp( bytes, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC) ) != 0 )
+        return 0;
+    memcpy( header, bytes, v1 );
+    if( header->version == 1 )
+    {
+        header->encoding = TRAJECTORY_RAW;
+        header->keyframes = 1;
+        return v1;
+    }
+    if( header->version < 2 || header->version > TRAJECTORY_VERSION || length < sizeof(trajectory_header_t) )
+        return 0;
+    memcpy( header, bytes, sizeof(trajectory_header_t) );
+    if( header->version == 2 )
+        header->counted = 0;
+    return sizeof(trajectory_header_t);
+}
+
+//
+//  open a trajectory for reading and load its frame index
+//
+trajectory_reader_t *openTrajectoryReader( const char *filename )
+{
+    FILE *f = fopen( filename, "rb" );
+    if( !f )
+    {
+        fprintf( stderr, "cannot open %s\n", filename );
+        return NULL;
+    }
+
+    char bytes[sizeof(trajectory_header_t)];
+    trajectory_header_t header;
+    size_t start = parseTrajectoryHeader( bytes, fread( bytes, 1, sizeof(bytes), f ), &header );
+    if( start == 0 )
+    {
+        fprintf( stderr, "%s is not a trajectory file of version %d or older\n", filename, TRAJECTORY_VERSION );
+        fclose( f );
+        return NULL;
+    }
+
+    trajectory_reader_t *r = (trajectory_reader_t*) calloc( 1, sizeof(trajectory_reader_t) );
+    r->f = f;
+    r->header = header;
+    r->decoded = -1;
+
+    //
+    //  without a (complete) index all complete frames up to the table or
+    //  the end of the file count
+    //
+    if( header.indexOffset > 0 )
+    {
+        r->index = (trajectory_frame_t*) malloc( max( header.frames, 1 ) * sizeof(trajectory_frame_t) );
+        fseeko( f, header.indexOffset, SEEK_SET );
+        if( fread( r->index, sizeof(trajectory_frame_t), header.frames, f ) != (size_t)header.frames )
+        {
+            free( r->index );
+            r->index = NULL;
+        }
+    }
+    if( !r->index )
+    {
+        fseeko( f, 0, SEEK_END );
+        long long end = ftello( f );
+        if( header.indexOffset > 0 && header.indexOffset < end )
+            end = header.indexOffset;
+        r->header.frames = rebuildIndex( f, &header, start, end, &r->index );
+    }
+
+    if( header.encoding == TRAJECTORY_DELTA )
+        r->quantized = (unsigned int*) malloc( max( (int)header.n, 1 ) * 2 * sizeof(unsigned int) );
+    return r;
+}
+
+//
+//  read the bytes of a frame into the buffer of the reader
+//
+static bool loadFrame( trajectory_reader_t *r, int frame )
+{
+    const trajectory_frame_t &entry = r->index[frame];
+    if( (size_t)entry.bytes > r->bufferSize )
+    {
+        r->bufferSize = entry.bytes;
+        r->buffer = (unsigned char*) realloc( r->buffer, r->bufferSize );
+    }
+    fseeko( r->f, entry.offset, SEEK_SET );
+    return fread( r->buffer, 1, entry.bytes, r->f ) == (size_t)entry.bytes;
+}
+
+//
+//  apply the varints of a delta frame of the given length to the quantized
+//  positions, false if the frame ends early
+//
+bool decodeDeltaFrame( const unsigned char *in, long long bytes, long long values, bool key, unsigned int *q )
+{
+    const unsigned char *end = in + bytes;
+    for( long long i = 0; i < values; i++ )
+    {
+        unsigned long long z = 0;
+        int shift = 0;
+        while( in < end && ( *in & 0x80 ) && shift < 63 )
+        {
+            z |= (unsigned long long)( *in++ & 0x7f ) << shift;
+            shift += 7;
+        }
+        if( in == end )
+            return false;
+        z |= (unsigned long long)*in++ << shift;
+        long long d = (long long)( z >> 1 ) ^ -(long long)( z & 1 );
+        q[i] = (unsigned int)( key ? d : q[i] + d );
+    }
+    return true;
+}
+
+static bool decodeFrame( trajectory_reader_t *r, int frame )
+{
+    return loadFrame( r, frame ) &&
+           decodeDeltaFrame( r->buffer, r->index[frame].bytes, 2 * r->header.n, frame % r->header.keyframes == 0, r->quantized );
+}
+
+//
+//  positions of one frame as doubles, xy holds 2 n values of which the
+//  first 2 count are set
+//
+bool readFrame( trajectory_reader_t *r, int frame, double *xy )
+{
+    if( frame < 0 || frame >= r->header.frames )
+        return false;
+    long long values = 2 * r->header.n;
+    r->count = (int)r->header.n;
+
+    if( r->header.encoding == TRAJECTORY_DELTA )
+    {
+        int first = frame - frame % r->header.keyframes;
+        if( r->decoded >= first && r->decoded <= frame )
+            first = r->decoded + 1;
+        for( int k = first; k <= frame; k++ )
+        {
+            if( !decodeFrame( r, k ) )
+            {
+                r->decoded = -1;
+                return false;
+            }
+            r->decoded = k;
+        }
+        double scale = quantizationScale( &r->header );
+        for( long long i = 0; i < values; i++ )
+            xy[i] = r->quantized[i] / scale;
+        return true;
+    }
+
+    if( !loadFrame( r, frame ) )
+        return false;
+    const unsigned char *data = r->buffer;
+    if( r->header.counted )
+    {
+        long long bytes = countedFrameBytes( &r->header, (const char*) data, r->index[frame].bytes );
+        if( bytes == 0 || bytes > r->index[frame].bytes )
+            return false;
+        values = ( bytes - sizeof(long long) ) / r->header.precision;
+        r->count = (int)( values / 2 );
+        data += sizeof(long long);
+    }else if( r->index[frame].bytes < values * r->header.precision ) {
+        return false;
+    }
+    if( r->header.precision == sizeof(float) )
+    {
+        const float *packed = (const float*) data;
+        for( long long i = 0; i < values; i++ )
+            xy[i] = packed[i];
+    }else {
+        memcpy( xy, data, values * sizeof(double) );
+    }
+    return true;
+}
+
+void closeTrajectoryReader( trajectory_reader_t *r )
+{
+    fclose( r->f );
+    free( r->index );
+    free( r->quantized );
+    free( r->buffer );
+    free( r );
+}
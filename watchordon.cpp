@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <math.h>
+#include "common.h"
+#include "stream.h"
+
+//
+//  follows the frames a running simulation publishes with -stream and
+//  prints a summary of each, computed straight from the shared memory
+//
+int main( int argc, char **argv )
+{
+    if( find_option( argc, argv, "-h" ) >= 0 || find_option( argc, argv, "-i" ) < 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-i <name> to specify the stream the simulation was started with\n" );
+        printf( "-all to read every frame instead of only the latest one\n" );
+        printf( "-frames <int> to stop after that many frames\n" );
+        printf( "-wait <int> to wait that many seconds for the simulation to start (default 10)\n" );
+        return 0;
+    }
+
+    char *name = read_string( argc, argv, "-i", NULL );
+    bool all = find_option( argc, argv, "-all" ) >= 0;
+    int limit = read_int( argc, argv, "-frames", -1 );
+    double wait = read_int( argc, argv, "-wait", 10 );
+
+    stream_reader_t *stream = NULL;
+    double start = read_timer( );
+    while( !( stream = attachStream( name ) ) && read_timer( ) - start < wait )
+        usleep( 10000 );
+    if( !stream )
+    {
+        fprintf( stderr, "no stream %s\n", name );
+        return 1;
+    }
+    printf( "attached to %s: %lld particles, %d slots\n", name, stream->header->n, stream->header->slots );
+
+    //
+    //  frames that were overwritten before they could be read are skipped,
+    //  the ones overwritten while being read are torn
+    //
+    unsigned long long next = 0;
+    int seen = 0, skipped = 0, torn = 0;
+    while( limit < 0 || seen < limit )
+    {
+        bool closed = streamClosed( stream );
+        unsigned long long published = publishedFrames( stream );
+        if( published <= next )
+        {
+            if( closed )
+                break;
+            usleep( 1000 );
+            continue;
+        }
+        unsigned long long oldest = published > (unsigned long long)stream->header->slots ? published - stream->header->slots : 0;
+        unsigned long long frame = all ? ( next > oldest ? next : oldest ) : published - 1;
+        skipped += (int)( frame - next );
+        next = frame + 1;
+
+        stream_frame_t view;
+        if( !viewStreamFrame( stream, frame, &view ) )
+        {
+            skipped++;
+            continue;
+        }
+        double cx = 0, cy = 0, spread = 0;
+        for( int i = 0; i < view.count; i++ )
+        {
+            cx += view.xy[2*i];
+            cy += view.xy[2*i+1];
+        }
+        cx /= max( view.count, 1 );
+        cy /= max( view.count, 1 );
+        for( int i = 0; i < view.count; i++ )
+            spread += ( view.xy[2*i] - cx ) * ( view.xy[2*i] - cx ) + ( view.xy[2*i+1] - cy ) * ( view.xy[2*i+1] - cy );
+        if( !streamFrameValid( &view ) )
+        {
+            torn++;
+            continue;
+        }
+        printf( "step %lld: %d particles, centre (%g, %g), spread %g\n", view.step, view.count, cx, cy, sqrt( spread / max( view.count, 1 ) ) );
+        seen++;
+    }
+    printf( "%d frames read, %d skipped, %d torn\n", seen, skipped, torn );
+
+    detachStream( stream );
+    return 0;
+}